@@ -0,0 +1,67 @@
+#!/bin/bash
+#  Throughput of 'cat input | cat stdin | ... | cat stdin > /dev/null' with 2, 4 and 8
+#  stages, each run by the shell and the cat of two revisions, so that the pipes between the
+#  stages are the ones exec_commands_with_pipes() makes.
+#
+#  usage: bench/cat_pipeline.sh BEFORE AFTER [SIZE]
+#         BEFORE and AFTER are any git revisions, SIZE is a head -c size and defaults to 8M.
+#
+#  The later stages read stdin, a link to /dev/stdin, rather than being a bare cat, which the
+#  shell drops from a pipeline as a passthrough; the leading 'cat input' may become an input
+#  redirect. The short names keep the 8 stages within the MAX_LEN of a command line.
+
+set -e
+
+if [ $# -lt 2 ]; then
+    echo "usage: $0 BEFORE AFTER [SIZE]" >&2
+    exit 2
+fi
+
+before=$1
+after=$2
+size=${3:-8M}
+repo=$(git -C "$(dirname "$0")" rev-parse --show-toplevel)
+work=$(mktemp -d)
+trap 'rm -rf "$work"' EXIT
+
+# the tree carries built binaries too, as old as the sources, so force a rebuild
+build() {
+    mkdir -p "$work/$1"
+    git -C "$repo" archive "$2" src | tar -x -C "$work/$1"
+    make -B -s -C "$work/$1/src" shell-core/shell commands/cat > /dev/null
+    ln -s /dev/stdin "$work/$1/src/shell-core/stdin"
+    ln -s "$work/input" "$work/$1/src/shell-core/input"
+}
+
+# the shell finds the commands through ../commands, and thus runs from shell-core
+run_shell() {
+    (cd "$work/$1/src/shell-core" && echo "$2" | ./shell > /dev/null)
+}
+
+head -c "$size" /dev/urandom > "$work/input"
+build before "$before"
+build after "$after"
+bytes=$(stat -c %s "$work/input")
+
+for stages in 2 4 8; do
+    pipeline="cat input"
+    for i in $(seq 2 "$stages"); do
+        pipeline="$pipeline | cat stdin"
+    done
+
+    for version in before after; do
+        start=$(date +%s.%N)
+        run_shell "$version" "$pipeline > /dev/null"
+        end=$(date +%s.%N)
+        awk -v stages="$stages" -v version="$version" -v bytes="$bytes" -v seconds="$(echo "$end $start" | awk '{print $1 - $2}')" \
+            'BEGIN { printf "%d stages, %s: %.3f s, %.1f MiB/s", stages, version, seconds, bytes / seconds / 1048576 }'
+
+        rm -f "$work/$version/src/shell-core/output"
+        run_shell "$version" "$pipeline > output"
+        if cmp -s "$work/$version/src/shell-core/output" "$work/input"; then
+            echo
+        else
+            echo " (wrong output)"
+        fi
+    done
+done
@@ -0,0 +1,607 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <sys/sendfile.h>
+#include <linux/fs.h>
+#include "bool.h"
+#include "copy.h"
+
+/* bytes asked from the kernel per copy_file_range() or sendfile() call */
+#define KERNEL_CHUNK_SIZE (1 << 30)
+
+/* the fallback buffer, aligned to the page so that it also suits O_DIRECT */
+#define COPY_BUFFER_SIZE (1 << 20)
+
+#define COPY_BUFFER_ALIGNMENT 4096
+
+/* O_DIRECT wants the buffers, offsets and lengths aligned to the logical block size, at most this */
+#define DIRECT_ALIGNMENT 4096
+
+/* each of the two buffers that the reader thread and the writer pass between them */
+#define DIRECT_BUFFER_SIZE (4 << 20)
+
+/* how far the copy cursor goes before the pages behind it are dropped */
+#define NOCACHE_WINDOW (8 << 20)
+
+/* how much of both files compare_streams() reads and compares at a time */
+#define COMPARE_BLOCK_SIZE (1 << 20)
+
+/* the granularity at which --sparse=always looks for zeros, as file systems allocate in blocks */
+#define SPARSE_BLOCK_SIZE 4096
+
+static const char *method_names[COPY_METHODS] = {
+    [COPY_BY_CLONE] = "clone",
+    [COPY_BY_SPARSE] = "sparse",
+    [COPY_BY_DIRECT] = "direct",
+    [COPY_BY_COPY_FILE_RANGE] = "copy_file_range",
+    [COPY_BY_SENDFILE] = "sendfile",
+    [COPY_BY_BUFFER] = "buffer",
+    [COPY_BY_URING] = "io_uring",
+};
+
+/* the errors with which a method tells it does not apply to the pair of files */
+static bool is_unsupported(int error) {
+    return error == EXDEV || error == EINVAL || error == ENOSYS || error == EOPNOTSUPP ||
+           error == ENOTTY || error == EBADF || error == EPERM || error == ETXTBSY;
+}
+
+/* write all of the bytes, resuming after partial writes and signals */
+static int write_bytes(int fd, const char *p, size_t count) {
+    ssize_t nbytes;
+
+    while (count > 0) {
+        if ((nbytes = write(fd, p, count)) == -1) {
+            if (errno == EINTR) continue;
+            return -1;
+        }
+        p += nbytes;
+        count -= nbytes;
+    }
+
+    return 0;
+}
+
+static int write_bytes_at(int fd, const char *p, size_t count, off_t offset) {
+    ssize_t nbytes;
+
+    while (count > 0) {
+        if ((nbytes = pwrite(fd, p, count, offset)) == -1) {
+            if (errno == EINTR) continue;
+            return -1;
+        }
+        p += nbytes;
+        count -= nbytes;
+        offset += nbytes;
+    }
+
+    return 0;
+}
+
+static bool is_zero_block(const char *p, size_t count) {
+    return *p == 0 && memcmp(p, p + 1, count - 1) == 0;
+}
+
+/*  Copy [offset, end) through the buffer, leaving out the blocks of zeros if detect_zeros,
+ *  which become holes as long as nothing is written there.
+ */
+static int copy_range_by_buffer(int input_fd, int output_fd, off_t offset, off_t end, bool detect_zeros, off_t *bytes_buf) {
+    char *buffer;
+    ssize_t nbytes;
+    size_t block, run;
+    int retval = 0;
+
+    if (posix_memalign((void **)&buffer, COPY_BUFFER_ALIGNMENT, COPY_BUFFER_SIZE) != 0) {
+        return -1;
+    }
+
+    while (offset < end && retval == 0) {
+        nbytes = pread(input_fd, buffer, end - offset < COPY_BUFFER_SIZE ? end - offset : COPY_BUFFER_SIZE, offset);
+        if (nbytes == -1) {
+            if (errno == EINTR) continue;
+            retval = -1;
+            break;
+        }
+        if (nbytes == 0) {
+            break;
+        }
+
+        for (size_t i = 0; i < (size_t)nbytes && retval == 0; i += run) {
+            block = (size_t)nbytes - i < SPARSE_BLOCK_SIZE ? (size_t)nbytes - i : SPARSE_BLOCK_SIZE;
+            if (detect_zeros && is_zero_block(buffer + i, block)) {
+                run = block;
+                continue;
+            }
+
+            /* gather the following non-zero blocks into a single write */
+            run = block;
+            while (i + run < (size_t)nbytes) {
+                block = (size_t)nbytes - i - run < SPARSE_BLOCK_SIZE ? (size_t)nbytes - i - run : SPARSE_BLOCK_SIZE;
+                if (detect_zeros && is_zero_block(buffer + i + run, block)) break;
+                run += block;
+            }
+
+            retval = write_bytes_at(output_fd, buffer + i, run, offset + i);
+            *bytes_buf += run;
+        }
+
+        offset += nbytes;
+    }
+
+    free(buffer);
+
+    return retval;
+}
+
+static int copy_range(int input_fd, int output_fd, off_t offset, off_t end, bool detect_zeros, off_t *bytes_buf) {
+    off_t output_offset = offset;
+    ssize_t nbytes;
+
+    while (!detect_zeros && offset < end) {
+        nbytes = copy_file_range(input_fd, &offset, output_fd, &output_offset, end - offset, 0);
+        if (nbytes == -1) {
+            if (errno == EINTR) continue;
+            if (!is_unsupported(errno)) return -1;
+            break;
+        }
+        if (nbytes == 0) {
+            return 0;
+        }
+        *bytes_buf += nbytes;
+    }
+
+    return copy_range_by_buffer(input_fd, output_fd, offset, end, detect_zeros, bytes_buf);
+}
+
+/*  Walk the data extents with SEEK_DATA / SEEK_HOLE, copying them at the same offsets of the
+ *  destination, and extend it to the full size so that the trailing hole is kept too.
+ *  Return 1 if the file system cannot tell the holes, before anything is copied.
+ */
+static int copy_by_extents(int input_fd, int output_fd, off_t offset, off_t size, bool detect_zeros, off_t *bytes_buf) {
+    off_t data, hole;
+
+    while (offset < size) {
+        if ((data = lseek(input_fd, offset, SEEK_DATA)) == -1) {
+            if (errno == ENXIO) break;
+            return offset == 0 && is_unsupported(errno) ? 1 : -1;
+        }
+        if ((hole = lseek(input_fd, data, SEEK_HOLE)) == -1) {
+            return -1;
+        }
+        if (hole > size) {
+            hole = size;
+        }
+        if (copy_range(input_fd, output_fd, data, hole, detect_zeros, bytes_buf) == -1) {
+            return -1;
+        }
+        offset = hole;
+    }
+
+    return ftruncate(output_fd, size);
+}
+
+/*  Where the streaming methods started in both files, for --nocache to drop the pages behind
+ *  them a window at a time. output_start is -1 if the destination is not a regular file.
+ */
+typedef struct cache_cursor {
+    bool is_enabled;
+    off_t input_start;
+    off_t output_start;
+    off_t dropped;
+    size_t chunk_size;          /* of each kernel call, so that the cursor is looked at often enough */
+} cache_cursor;
+
+/*  Dirty pages cannot be dropped before they are written back, so the destination window is
+ *  written and waited for first. The source pages are clean, and go right away.
+ */
+static void drop_behind(int input_fd, int output_fd, struct cache_cursor *cursor, off_t copied) {
+    off_t length = copied - cursor->dropped;
+
+    if (!cursor->is_enabled || length < NOCACHE_WINDOW) {
+        return;
+    }
+
+    posix_fadvise(input_fd, cursor->input_start + cursor->dropped, length, POSIX_FADV_DONTNEED);
+
+    if (cursor->output_start != -1) {
+        sync_file_range(output_fd, cursor->output_start + cursor->dropped, length,
+                        SYNC_FILE_RANGE_WAIT_BEFORE | SYNC_FILE_RANGE_WRITE | SYNC_FILE_RANGE_WAIT_AFTER);
+        posix_fadvise(output_fd, cursor->output_start + cursor->dropped, length, POSIX_FADV_DONTNEED);
+    }
+
+    cursor->dropped = copied;
+}
+
+/* the rest, whatever method did the copy */
+static void drop_all(int input_fd, int output_fd, const struct cache_cursor *cursor) {
+    posix_fadvise(input_fd, 0, 0, POSIX_FADV_DONTNEED);
+
+    if (cursor->output_start != -1) {
+        fdatasync(output_fd);
+        posix_fadvise(output_fd, 0, 0, POSIX_FADV_DONTNEED);
+    }
+}
+
+/*  O_DIRECT transfers go straight between the device and the buffer, and want the file offset
+ *  and length aligned too, so an unaligned tail, and any write the file system refuses, is
+ *  written through the page cache instead.
+ */
+static int write_direct(int fd, const char *p, size_t count) {
+    size_t aligned = count & ~(size_t)(DIRECT_ALIGNMENT - 1);
+    ssize_t nbytes = 0;
+
+    if (aligned > 0 && (fcntl(fd, F_GETFL) & O_DIRECT)) {
+        while ((nbytes = write(fd, p, aligned)) == -1 && errno == EINTR);
+        if (nbytes == -1 && errno != EINVAL) {
+            return -1;
+        }
+        if (nbytes > 0) {
+            p += nbytes;
+            count -= nbytes;
+        }
+    }
+
+    if (count > 0) {
+        fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) & ~O_DIRECT);
+    }
+
+    return write_bytes(fd, p, count);
+}
+
+/*  The reader thread fills the two buffers in turn while the caller writes the other one out,
+ *  so that the device is kept busy on both sides, which O_DIRECT would otherwise serialize.
+ */
+typedef struct direct_pipeline {
+    int fd;
+    char *buffers[2];
+    ssize_t lengths[2];         /* a short one ends the stream, and -1 is an error */
+    int error;
+    size_t filled;
+    bool is_stopped;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+} direct_pipeline;
+
+static void * read_ahead(void *arg) {
+    struct direct_pipeline *pipeline = (struct direct_pipeline *)arg;
+    ssize_t nbytes;
+    bool is_stopped;
+
+    for (size_t i = 0; ; i++) {
+        /* is_stopped is set under the lock by the writer, so it is taken out before unlocking */
+        pthread_mutex_lock(&pipeline->lock);
+        while (pipeline->filled == 2 && !pipeline->is_stopped) {
+            pthread_cond_wait(&pipeline->cond, &pipeline->lock);
+        }
+        is_stopped = pipeline->is_stopped;
+        pthread_mutex_unlock(&pipeline->lock);
+
+        if (is_stopped) {
+            break;
+        }
+
+        while ((nbytes = read(pipeline->fd, pipeline->buffers[i % 2], DIRECT_BUFFER_SIZE)) == -1 && errno == EINTR);
+
+        pthread_mutex_lock(&pipeline->lock);
+        pipeline->lengths[i % 2] = nbytes;
+        pipeline->error = nbytes == -1 ? errno : 0;
+        pipeline->filled++;
+        pthread_cond_signal(&pipeline->cond);
+        pthread_mutex_unlock(&pipeline->lock);
+
+        if (nbytes != DIRECT_BUFFER_SIZE) {
+            break;
+        }
+    }
+
+    return NULL;
+}
+
+static int pass_buffers(struct direct_pipeline *pipeline, int output_fd, off_t *bytes_buf) {
+    ssize_t nbytes;
+
+    for (size_t i = 0; ; i++) {
+        pthread_mutex_lock(&pipeline->lock);
+        while (pipeline->filled == 0) {
+            pthread_cond_wait(&pipeline->cond, &pipeline->lock);
+        }
+        nbytes = pipeline->lengths[i % 2];
+        pthread_mutex_unlock(&pipeline->lock);
+
+        if (nbytes == -1) {
+            /* a file system without O_DIRECT support refuses the very first read */
+            return i == 0 && pipeline->error == EINVAL ? 1 : -1;
+        }
+        if (write_direct(output_fd, pipeline->buffers[i % 2], nbytes) == -1) {
+            return -1;
+        }
+        *bytes_buf += nbytes;
+
+        pthread_mutex_lock(&pipeline->lock);
+        pipeline->filled--;
+        pthread_cond_signal(&pipeline->cond);
+        pthread_mutex_unlock(&pipeline->lock);
+
+        if (nbytes != DIRECT_BUFFER_SIZE) {
+            return 0;
+        }
+    }
+}
+
+static int copy_by_direct(int input_fd, int output_fd, off_t input_offset, off_t *bytes_buf) {
+    struct direct_pipeline pipeline;
+    struct stat output_attribute;
+    pthread_t reader;
+    int input_flags = fcntl(input_fd, F_GETFL), output_flags = fcntl(output_fd, F_GETFL);
+    int retval = -1;
+
+    if (input_offset % DIRECT_ALIGNMENT != 0 || fcntl(input_fd, F_SETFL, input_flags | O_DIRECT) == -1) {
+        return 1;
+    }
+
+    /* O_DIRECT would turn a pipe into packet mode, so only files get it */
+    if (fstat(output_fd, &output_attribute) == 0 && S_ISREG(output_attribute.st_mode) &&
+        lseek(output_fd, 0, SEEK_CUR) % DIRECT_ALIGNMENT == 0) {
+        fcntl(output_fd, F_SETFL, output_flags | O_DIRECT);
+    }
+
+    memset(&pipeline, 0, sizeof pipeline);
+    pipeline.fd = input_fd;
+    pthread_mutex_init(&pipeline.lock, NULL);
+    pthread_cond_init(&pipeline.cond, NULL);
+
+    if (posix_memalign((void **)&pipeline.buffers[0], DIRECT_ALIGNMENT, DIRECT_BUFFER_SIZE) == 0 &&
+        posix_memalign((void **)&pipeline.buffers[1], DIRECT_ALIGNMENT, DIRECT_BUFFER_SIZE) == 0 &&
+        pthread_create(&reader, NULL, read_ahead, &pipeline) == 0) {
+        retval = pass_buffers(&pipeline, output_fd, bytes_buf);
+
+        pthread_mutex_lock(&pipeline.lock);
+        pipeline.is_stopped = true;
+        pthread_cond_signal(&pipeline.cond);
+        pthread_mutex_unlock(&pipeline.lock);
+        pthread_join(reader, NULL);
+    }
+
+    free(pipeline.buffers[0]);
+    free(pipeline.buffers[1]);
+    pthread_mutex_destroy(&pipeline.lock);
+    pthread_cond_destroy(&pipeline.cond);
+    fcntl(input_fd, F_SETFL, input_flags);
+    fcntl(output_fd, F_SETFL, output_flags);
+
+    return retval;
+}
+
+/*  Both kernel paths advance the file offsets of the fds, so that a method giving up in the
+ *  middle leaves the next one to resume where it stopped. Return 1 if the method is not
+ *  supported, 0 at the end of input, and -1 on real errors.
+ */
+static int copy_by_copy_file_range(int input_fd, int output_fd, struct cache_cursor *cursor, off_t *bytes_buf) {
+    ssize_t nbytes;
+
+    while ((nbytes = copy_file_range(input_fd, NULL, output_fd, NULL, cursor->chunk_size, 0)) != 0) {
+        if (nbytes == -1) {
+            if (errno == EINTR) continue;
+            return is_unsupported(errno) ? 1 : -1;
+        }
+        *bytes_buf += nbytes;
+        drop_behind(input_fd, output_fd, cursor, *bytes_buf);
+    }
+
+    return 0;
+}
+
+static int copy_by_sendfile(int input_fd, int output_fd, struct cache_cursor *cursor, off_t *bytes_buf) {
+    ssize_t nbytes;
+
+    while ((nbytes = sendfile(output_fd, input_fd, NULL, cursor->chunk_size)) != 0) {
+        if (nbytes == -1) {
+            if (errno == EINTR) continue;
+            return is_unsupported(errno) ? 1 : -1;
+        }
+        *bytes_buf += nbytes;
+        drop_behind(input_fd, output_fd, cursor, *bytes_buf);
+    }
+
+    return 0;
+}
+
+static int copy_by_buffer(int input_fd, int output_fd, struct cache_cursor *cursor, off_t *bytes_buf) {
+    char *buffer;
+    ssize_t nbytes;
+    int retval = 0;
+
+    if (posix_memalign((void **)&buffer, COPY_BUFFER_ALIGNMENT, COPY_BUFFER_SIZE) != 0) {
+        return -1;
+    }
+
+    while ((nbytes = read(input_fd, buffer, COPY_BUFFER_SIZE)) != 0) {
+        if (nbytes == -1) {
+            if (errno == EINTR) continue;
+            retval = -1;
+            break;
+        }
+        if (write_bytes(output_fd, buffer, nbytes) == -1) {
+            retval = -1;
+            break;
+        }
+        *bytes_buf += nbytes;
+        drop_behind(input_fd, output_fd, cursor, *bytes_buf);
+    }
+
+    free(buffer);
+
+    return retval;
+}
+
+/* the reflink and the extents leave the offsets where they were, unlike the streaming methods */
+static int end_at(int input_fd, int output_fd, off_t size) {
+    return lseek(input_fd, size, SEEK_SET) == -1 || lseek(output_fd, size, SEEK_SET) == -1 ? -1 : 0;
+}
+
+static int copy_by_any(int input_fd, int output_fd, const struct copy_options *options, struct cache_cursor *cursor,
+                       enum copy_method *method_buf, off_t *bytes_buf) {
+    struct stat input_attribute, output_attribute;
+    off_t offset;
+    int retval;
+
+    /* under O_APPEND every write goes to the end, so the clone and the pwrite() at offsets are out */
+    if (fstat(input_fd, &input_attribute) == 0 && S_ISREG(input_attribute.st_mode) &&
+        fstat(output_fd, &output_attribute) == 0 && S_ISREG(output_attribute.st_mode) &&
+        !(fcntl(output_fd, F_GETFL) & O_APPEND) &&
+        (offset = lseek(input_fd, 0, SEEK_CUR)) != -1 && lseek(output_fd, 0, SEEK_CUR) == offset) {
+        if (options->sparse == SPARSE_AUTO && offset == 0 && output_attribute.st_size == 0 &&
+            ioctl(output_fd, FICLONE, input_fd) == 0) {
+            *method_buf = COPY_BY_CLONE;
+            *bytes_buf = input_attribute.st_size;
+            return end_at(input_fd, output_fd, input_attribute.st_size);
+        }
+
+        if (options->sparse == SPARSE_ALWAYS ||
+            (options->sparse == SPARSE_AUTO && input_attribute.st_blocks * 512 < input_attribute.st_size)) {
+            *method_buf = COPY_BY_SPARSE;
+            if ((retval = copy_by_extents(input_fd, output_fd, offset, input_attribute.st_size,
+                                          options->sparse == SPARSE_ALWAYS, bytes_buf)) != 1) {
+                return retval == 0 ? end_at(input_fd, output_fd, input_attribute.st_size) : retval;
+            }
+        }
+    }
+
+    if (options->is_direct && fstat(input_fd, &input_attribute) == 0 && S_ISREG(input_attribute.st_mode)) {
+        *method_buf = COPY_BY_DIRECT;
+        if ((retval = copy_by_direct(input_fd, output_fd, lseek(input_fd, 0, SEEK_CUR), bytes_buf)) != 1) {
+            return retval;
+        }
+    }
+
+    *method_buf = COPY_BY_COPY_FILE_RANGE;
+    if ((retval = copy_by_copy_file_range(input_fd, output_fd, cursor, bytes_buf)) != 1) {
+        return retval;
+    }
+
+    *method_buf = COPY_BY_SENDFILE;
+    if ((retval = copy_by_sendfile(input_fd, output_fd, cursor, bytes_buf)) != 1) {
+        return retval;
+    }
+
+    *method_buf = COPY_BY_BUFFER;
+    return copy_by_buffer(input_fd, output_fd, cursor, bytes_buf);
+}
+
+/*  Copy the rest of input_fd into output_fd with the cheapest method that works. On success,
+ *  the method that finished the copy and the number of bytes copied are stored. Holes are
+ *  only made between regular files at the same offsets, and a reflink shares them as they
+ *  are, so it is only tried under the default sparse mode.
+ */
+extern int copy_stream(int input_fd, int output_fd, const struct copy_options *options, enum copy_method *method_buf, off_t *bytes_buf) {
+    struct cache_cursor cursor;
+    struct stat output_attribute;
+    int retval;
+
+    *bytes_buf = 0;
+
+    cursor.is_enabled = options->is_nocache;
+    cursor.input_start = lseek(input_fd, 0, SEEK_CUR);
+    cursor.output_start = fstat(output_fd, &output_attribute) == 0 && S_ISREG(output_attribute.st_mode) ?
+                          lseek(output_fd, 0, SEEK_CUR) : -1;
+    cursor.dropped = 0;
+    cursor.chunk_size = options->is_nocache ? NOCACHE_WINDOW : KERNEL_CHUNK_SIZE;
+
+    retval = copy_by_any(input_fd, output_fd, options, &cursor, method_buf, bytes_buf);
+
+    if (options->is_nocache) {
+        drop_all(input_fd, output_fd, &cursor);
+    }
+
+    return retval;
+}
+
+static ssize_t read_block(int fd, char *p, size_t count) {
+    ssize_t nbytes;
+    size_t total = 0;
+
+    while (total < count) {
+        if ((nbytes = read(fd, p + total, count - total)) == -1) {
+            if (errno == EINTR) continue;
+            return -1;
+        }
+        if (nbytes == 0) break;
+        total += nbytes;
+    }
+
+    return total;
+}
+
+/*  Compare both streams block by block with memcmp(), which is exact and, with both blocks
+ *  in memory, faster than hashing them, and stop at the first block that differs. Return 1 if
+ *  they have the same contents, 0 if not, and -1 on errors.
+ */
+extern int compare_streams(int fd_A, int fd_B) {
+    char *buffer_A, *buffer_B;
+    ssize_t nbytes_A, nbytes_B;
+    int retval = -1;
+
+    buffer_A = (char *)malloc(COMPARE_BLOCK_SIZE);
+    buffer_B = (char *)malloc(COMPARE_BLOCK_SIZE);
+
+    while (buffer_A != NULL && buffer_B != NULL) {
+        nbytes_A = read_block(fd_A, buffer_A, COMPARE_BLOCK_SIZE);
+        nbytes_B = read_block(fd_B, buffer_B, COMPARE_BLOCK_SIZE);
+
+        if (nbytes_A == -1 || nbytes_B == -1) {
+            break;
+        }
+        if (nbytes_A != nbytes_B || memcmp(buffer_A, buffer_B, nbytes_A) != 0) {
+            retval = 0;
+            break;
+        }
+        if (nbytes_A == 0) {
+            retval = 1;
+            break;
+        }
+    }
+
+    free(buffer_A);
+    free(buffer_B);
+
+    return retval;
+}
+
+extern void record_copy(struct copy_stats *stats, enum copy_method method, off_t bytes) {
+    stats->files[method]++;
+    stats->bytes[method] += bytes;
+}
+
+extern void print_copy_stats(const struct copy_stats *stats, const char *name, double seconds) {
+    unsigned long long files = 0, bytes = 0;
+
+    for (int i = 0; i < COPY_METHODS; i++) {
+        files += stats->files[i];
+        bytes += stats->bytes[i];
+    }
+
+    fprintf(stderr, "%s: %llu bytes from %llu files in %.3f s, %.1f MiB/s\n", name, bytes, files,
+            seconds, seconds > 0 ? bytes / seconds / (1 << 20) : 0.0);
+
+    for (int i = 0; i < COPY_METHODS; i++) {
+        if (stats->files[i] > 0) {
+            fprintf(stderr, "%s:   %-16s %8llu files %16llu bytes\n", name, method_names[i],
+                    stats->files[i], stats->bytes[i]);
+        }
+    }
+
+    if (stats->linked_files > 0) {
+        fprintf(stderr, "%s:   %-16s %8llu files\n", name, "hard link", stats->linked_files);
+    }
+
+    if (stats->skipped_files > 0) {
+        fprintf(stderr, "%s:   %-16s %8llu files %16llu bytes\n", name, "unchanged",
+                stats->skipped_files, stats->skipped_bytes);
+    }
+}
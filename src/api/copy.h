@@ -0,0 +1,55 @@
+#include <sys/types.h>
+
+#include "bool.h"
+
+/*  The ways copy_stream() may move the bytes, tried in this order: share the extents
+ *  (reflink), copy only the data extents of a sparse file, stream around the page cache if
+ *  asked to, copy inside the kernel between files, copy inside the kernel into any fd, and
+ *  read / write through a large aligned buffer as the last resort. Batches of small files
+ *  may also go through io_uring instead.
+ */
+typedef enum copy_method {
+    COPY_BY_CLONE,
+    COPY_BY_SPARSE,
+    COPY_BY_DIRECT,
+    COPY_BY_COPY_FILE_RANGE,
+    COPY_BY_SENDFILE,
+    COPY_BY_BUFFER,
+    COPY_BY_URING,
+    COPY_METHODS
+} copy_method;
+
+/*  When to leave holes in the destination: auto copies the holes of sparse sources, always
+ *  also turns blocks of zeros into holes, and never writes every byte out.
+ */
+typedef enum sparse_mode {
+    SPARSE_AUTO,
+    SPARSE_ALWAYS,
+    SPARSE_NEVER
+} sparse_mode;
+
+/*  is_direct reads, and writes when the destination allows, with O_DIRECT around the page
+ *  cache; is_nocache drops the pages behind the copy cursor, so that either keeps a huge copy
+ *  from evicting the working set.
+ */
+typedef struct copy_options {
+    enum sparse_mode sparse;
+    bool is_direct;
+    bool is_nocache;
+} copy_options;
+
+typedef struct copy_stats {
+    unsigned long long files[COPY_METHODS];
+    unsigned long long bytes[COPY_METHODS];
+    unsigned long long skipped_files;
+    unsigned long long skipped_bytes;
+    unsigned long long linked_files;
+} copy_stats;
+
+extern int copy_stream(int input_fd, int output_fd, const struct copy_options *options, enum copy_method *method_buf, off_t *bytes_buf);
+
+extern int compare_streams(int fd_A, int fd_B);
+
+extern void record_copy(struct copy_stats *stats, enum copy_method method, off_t bytes);
+
+extern void print_copy_stats(const struct copy_stats *stats, const char *name, double seconds);
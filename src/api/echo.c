@@ -0,0 +1,34 @@
+#include <stdlib.h>
+#include <string.h>
+#include "echo.h"
+
+/*  The line that echo prints for its arguments: the words after argv[0] joined by spaces, and
+ *  a newline. It is shared by commands/echo and the echo stages that shell runs as threads.
+ *  The memory is allocated by malloc, and thus needs to be freed manually.
+ */
+extern char * format_echo(int argc, char *argv[], size_t *length_buf) {
+    size_t length = 1;
+    char *line, *p;
+
+    for (int i = 1; i < argc; i++) {
+        length += strlen(argv[i]) + 1;
+    }
+
+    if ((p = line = (char *)malloc(length)) == NULL) {
+        return NULL;
+    }
+
+    for (int i = 1; i < argc; i++) {
+        size_t len = strlen(argv[i]);
+        memcpy(p, argv[i], len);
+        p += len;
+        *p++ = (i < argc - 1) ? ' ' : '\n';
+    }
+
+    if (argc <= 1) {
+        *p = '\n';
+    }
+
+    *length_buf = argc <= 1 ? 1 : length - 1;
+    return line;
+}
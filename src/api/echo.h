@@ -0,0 +1,3 @@
+#include <stddef.h>
+
+extern char * format_echo(int argc, char *argv[], size_t *length_buf);
\ No newline at end of file
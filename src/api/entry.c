@@ -6,12 +6,16 @@
 #include <pwd.h>
 #include <grp.h>
 #include <fcntl.h>
+#include <errno.h>
 #include <sys/stat.h>
 #include "limits.h"
 #include "bool.h"
 #include "error.h"
 #include "name.h"
 
+/* the first buffer for getpwuid_r() and getgrgid_r() if sysconf() suggests no size */
+#define NAME_BUFFER_SIZE 4096
+
 const char *program_name;
 
 typedef struct entry {
@@ -23,9 +27,65 @@ typedef struct entry {
     struct entry *next;
 } entry;
 
+/*  Cached by get_working_directory() together with the (dev, ino) it names, which is checked
+ *  against "." on each use, so a chdir() made behind the cache's back is noticed. It is held
+ *  in memory of getcwd(NULL, 0), as deep as the path goes.
+ *
+ *  Only the physical path that getcwd() returns is ever cached, never $PWD: a logical path
+ *  through a symbolic link would make the ".." that load_full_path() resolves by hand name
+ *  another directory than the ".." of the kernel.
+ */
+static char *working_directory = NULL;
+
+static dev_t working_directory_dev;
+
+static ino_t working_directory_ino;
+
+static void cache_working_directory(char *path, const struct stat *attribute) {
+    free(working_directory);
+    working_directory = path;
+    working_directory_dev = attribute->st_dev;
+    working_directory_ino = attribute->st_ino;
+}
+
+extern const char * get_working_directory() {
+    struct stat attribute;
+    char *path;
+
+    if (stat(".", &attribute) == -1) {
+        die("%s: Error: cannot get current working directory", program_name);
+    }
+
+    if (working_directory == NULL ||
+        attribute.st_dev != working_directory_dev || attribute.st_ino != working_directory_ino) {
+        if ((path = getcwd(NULL, 0)) == NULL) {
+            die("%s: Error: cannot get current working directory", program_name);
+        }
+        cache_working_directory(path, &attribute);
+    }
+    return working_directory;
+}
+
+/* chdir() and refresh the cache, exporting it to the children via $PWD */
+extern int change_working_directory(const char *path) {
+    struct stat attribute;
+    char *cwd;
+
+    if (chdir(path) == -1) {
+        return -1;
+    }
+
+    if (stat(".", &attribute) == -1 || (cwd = getcwd(NULL, 0)) == NULL) {
+        die("%s: Error: cannot get current working directory", program_name);
+    }
+
+    cache_working_directory(cwd, &attribute);
+    return setenv("PWD", working_directory, 1);
+}
+
 static void load_full_path(const char *path, char *path_buf) {
     if (*path != '/') {
-        if (snprintf(path_buf, MAX_LEN, "%s/%s", getcwd(NULL, 0), path) > MAX_LEN) {
+        if (snprintf(path_buf, MAX_LEN, "%s/%s", get_working_directory(), path) > MAX_LEN) {
             die("%s: Error: buffer overflowed", program_name);
         }
 
@@ -187,10 +247,11 @@ extern entry * get_entries_chain(const char *path) {
 }
 
 extern void free_entry(struct entry *entry) {
-    struct entry *p = entry;
+    struct entry *p = entry, *previous;
     while (p != NULL) {
+        previous = p->previous;
         free_entry_part(p);
-        p = p->previous;
+        p = previous;
     }
 }
 
@@ -215,9 +276,14 @@ extern bool is_empty_directory(const struct entry *entry) {
     struct dirent *element;
     const char *filename;
 
+    if (stream == NULL) return false;
+
     while ((element = readdir(stream)) != NULL) {
         filename = element->d_name;
-        if (strcmp(filename, ".") != 0 && strcmp(filename, "..") != 0) return false;
+        if (strcmp(filename, ".") != 0 && strcmp(filename, "..") != 0) {
+            closedir(stream);
+            return false;
+        }
     }
 
     closedir(stream);
@@ -240,6 +306,62 @@ extern bool is_subdirectory(const struct entry *entry_A, const struct entry *ent
     }
 }
 
+static size_t get_name_buffer_size(int name) {
+    long size = sysconf(name);
+    return size > 0 ? size : NAME_BUFFER_SIZE;
+}
+
+/*  getpwuid() and getgrgid() return static buffers shared by all threads, so the reentrant
+ *  ones are used instead, with a buffer that grows for as long as they fail with ERANGE, as a
+ *  group of many members may not fit the size sysconf() suggests. Fall back to the numeric id
+ *  if there is no such entry. The caller frees the name.
+ */
+extern char * get_user_name(uid_t uid) {
+    struct passwd user, *result = NULL;
+    size_t size = get_name_buffer_size(_SC_GETPW_R_SIZE_MAX);
+    char *buffer, *retval, name[MAX_LEN];
+
+    while ((buffer = (char *)malloc(size)) != NULL) {
+        if (getpwuid_r(uid, &user, buffer, size, &result) != ERANGE) break;
+        free(buffer);
+        size *= 2;
+    }
+
+    if (buffer != NULL && result != NULL) {
+        retval = strdup(user.pw_name);
+
+    } else {
+        snprintf(name, sizeof name, "%u", (unsigned)uid);
+        retval = strdup(name);
+    }
+
+    free(buffer);
+    return retval;
+}
+
+extern char * get_group_name(gid_t gid) {
+    struct group group, *result = NULL;
+    size_t size = get_name_buffer_size(_SC_GETGR_R_SIZE_MAX);
+    char *buffer, *retval, name[MAX_LEN];
+
+    while ((buffer = (char *)malloc(size)) != NULL) {
+        if (getgrgid_r(gid, &group, buffer, size, &result) != ERANGE) break;
+        free(buffer);
+        size *= 2;
+    }
+
+    if (buffer != NULL && result != NULL) {
+        retval = strdup(group.gr_name);
+
+    } else {
+        snprintf(name, sizeof name, "%u", (unsigned)gid);
+        retval = strdup(name);
+    }
+
+    free(buffer);
+    return retval;
+}
+
 extern bool is_directory_read_permitted(const struct entry *entry) {
     if (entry == NULL) return true;
     int retval;
@@ -247,16 +369,15 @@ extern bool is_directory_read_permitted(const struct entry *entry) {
     char *current_username, *current_groupname;
     mode_t mode_bits = entry->attribute->st_mode;
 
-    file_owner_username = strdup(getpwuid(entry->attribute->st_uid)->pw_name);
-    file_owner_groupname = strdup(getgrgid(entry->attribute->st_gid)->gr_name);
-    current_username = strdup(getpwuid(getuid())->pw_name);
-    current_groupname = strdup(getgrgid(getgid())->gr_name);
+    file_owner_username = get_user_name(entry->attribute->st_uid);
+    file_owner_groupname = get_group_name(entry->attribute->st_gid);
+    current_username = get_user_name(getuid());
+    current_groupname = get_group_name(getgid());
 
     if (strcmp(current_username, "root") == 0) {
-        return true;
-    }
+        retval = true;
 
-    if (strcmp(file_owner_username, current_username) == 0) {
+    } else if (strcmp(file_owner_username, current_username) == 0) {
         if ((mode_bits & S_IRUSR) && (mode_bits & S_IXUSR)) retval = true;
         else retval = false;
 
@@ -285,16 +406,15 @@ extern bool is_directory_write_permitted(const struct entry *entry) {
     char *current_username, *current_groupname;
     mode_t mode_bits = entry->attribute->st_mode;
 
-    file_owner_username = strdup(getpwuid(entry->attribute->st_uid)->pw_name);
-    file_owner_groupname = strdup(getgrgid(entry->attribute->st_gid)->gr_name);
-    current_username = strdup(getpwuid(getuid())->pw_name);
-    current_groupname = strdup(getgrgid(getgid())->gr_name);
+    file_owner_username = get_user_name(entry->attribute->st_uid);
+    file_owner_groupname = get_group_name(entry->attribute->st_gid);
+    current_username = get_user_name(getuid());
+    current_groupname = get_group_name(getgid());
 
     if (strcmp(current_username, "root") == 0) {
-        return true;
-    }
+        retval = true;
 
-    if (strcmp(file_owner_username, current_username) == 0) {
+    } else if (strcmp(file_owner_username, current_username) == 0) {
         if (mode_bits & S_IWUSR)  retval = true;
         else retval = false;
 
@@ -322,16 +442,15 @@ extern bool is_file_read_permitted(const struct entry *entry) {
     char *current_username, *current_groupname;
     mode_t mode_bits = entry->attribute->st_mode;
 
-    file_owner_username = strdup(getpwuid(entry->attribute->st_uid)->pw_name);
-    file_owner_groupname = strdup(getgrgid(entry->attribute->st_gid)->gr_name);
-    current_username = strdup(getpwuid(getuid())->pw_name);
-    current_groupname = strdup(getgrgid(getgid())->gr_name);
+    file_owner_username = get_user_name(entry->attribute->st_uid);
+    file_owner_groupname = get_group_name(entry->attribute->st_gid);
+    current_username = get_user_name(getuid());
+    current_groupname = get_group_name(getgid());
 
     if (strcmp(current_username, "root") == 0) {
-        return true;
-    }
+        retval = true;
 
-    if (strcmp(file_owner_username, current_username) == 0) {
+    } else if (strcmp(file_owner_username, current_username) == 0) {
         if (mode_bits & S_IRUSR)  retval = true;
         else retval = false;
 
@@ -360,16 +479,15 @@ extern bool is_file_write_permitted(const struct entry *entry) {
     char *current_username, *current_groupname;
     mode_t mode_bits = entry->attribute->st_mode;
 
-    file_owner_username = strdup(getpwuid(entry->attribute->st_uid)->pw_name);
-    file_owner_groupname = strdup(getgrgid(entry->attribute->st_gid)->gr_name);
-    current_username = strdup(getpwuid(getuid())->pw_name);
-    current_groupname = strdup(getgrgid(getgid())->gr_name);
+    file_owner_username = get_user_name(entry->attribute->st_uid);
+    file_owner_groupname = get_group_name(entry->attribute->st_gid);
+    current_username = get_user_name(getuid());
+    current_groupname = get_group_name(getgid());
 
     if (strcmp(current_username, "root") == 0) {
-        return true;
-    }
+        retval = true;
 
-    if (strcmp(file_owner_username, current_username) == 0) {
+    } else if (strcmp(file_owner_username, current_username) == 0) {
         if (mode_bits & S_IWUSR)  retval = true;
         else retval = false;
 
@@ -397,16 +515,15 @@ extern bool is_file_execute_permitted(const struct entry *entry) {
     char *current_username, *current_groupname;
     mode_t mode_bits = entry->attribute->st_mode;
 
-    file_owner_username = strdup(getpwuid(entry->attribute->st_uid)->pw_name);
-    file_owner_groupname = strdup(getgrgid(entry->attribute->st_gid)->gr_name);
-    current_username = strdup(getpwuid(getuid())->pw_name);
-    current_groupname = strdup(getgrgid(getgid())->gr_name);
+    file_owner_username = get_user_name(entry->attribute->st_uid);
+    file_owner_groupname = get_group_name(entry->attribute->st_gid);
+    current_username = get_user_name(getuid());
+    current_groupname = get_group_name(getgid());
 
     if (strcmp(current_username, "root") == 0) {
-        return true;
-    }
+        retval = true;
 
-    if (strcmp(file_owner_username, current_username) == 0) {
+    } else if (strcmp(file_owner_username, current_username) == 0) {
         if (mode_bits & S_IXUSR)  retval = true;
         else retval = false;
 
@@ -428,7 +545,8 @@ extern bool is_file_execute_permitted(const struct entry *entry) {
 }
 
 
-static entry * get_entry_dup(const entry *source) { 
+/* the memory is allocated by malloc, and thus needs to be freed */
+extern entry * get_entry_dup(const entry *source) {
     entry *buffer, **p = &buffer;
     while(source != NULL) {
         *p = (entry *)malloc(sizeof (entry));;
@@ -4,6 +4,8 @@
 
 #include <string.h>
 
+#include <sys/types.h>
+
 #include "bool.h"
 
 #include "name.h"
@@ -21,10 +23,16 @@ typedef struct entry {
     struct entry *next;
 } entry;
 
+extern const char * get_working_directory();
+
+extern int change_working_directory(const char *path);
+
 extern entry * get_entries_chain(const char *path);
 
 extern void free_entry(struct entry *entry);
 
+extern entry * get_entry_dup(const entry *source);
+
 extern entry * get_joint_entry(const char *filename, const entry *target);
 
 extern entry * get_real_destination(const char *filename, const struct entry *target);
@@ -41,6 +49,10 @@ extern bool is_same_entry(const struct entry *entry_A, const struct entry *entry
 
 extern bool is_subdirectory(const struct entry *entry_A, const struct entry *entry_B);
 
+extern char * get_user_name(uid_t uid);
+
+extern char * get_group_name(gid_t gid);
+
 extern bool is_directory_read_permitted(const struct entry *entry);
 
 extern bool is_directory_write_permitted(const struct entry *entry);
@@ -0,0 +1,266 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <sys/stat.h>
+#include "bool.h"
+#include "progress.h"
+
+/* a line is printed every this many intervals when stderr is not a terminal */
+#define LOG_INTERVALS 10
+
+static double get_seconds(const struct timespec *start) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - start->tv_sec) + (now.tv_nsec - start->tv_nsec) / 1e9;
+}
+
+/* add up the files and bytes under name, without following symbolic links */
+static void count_tree(struct progress *progress, int directory_fd, const char *name) {
+    struct stat attribute;
+    struct dirent *element;
+    DIR *stream;
+    int fd;
+
+    if (atomic_load_explicit(&progress->is_stopped, memory_order_relaxed) ||
+        fstatat(directory_fd, name, &attribute, AT_SYMLINK_NOFOLLOW) == -1) {
+        return;
+    }
+
+    if (!S_ISDIR(attribute.st_mode)) {
+        atomic_fetch_add_explicit(&progress->total_files, 1, memory_order_relaxed);
+        atomic_fetch_add_explicit(&progress->total_bytes, attribute.st_size, memory_order_relaxed);
+        return;
+    }
+
+    if ((fd = openat(directory_fd, name, O_RDONLY | O_DIRECTORY)) == -1) {
+        return;
+    }
+
+    if ((stream = fdopendir(fd)) == NULL) {
+        close(fd);
+        return;
+    }
+
+    while ((element = readdir(stream)) != NULL) {
+        if (strcmp(element->d_name, ".") == 0 || strcmp(element->d_name, "..") == 0) {
+            continue;
+        }
+        count_tree(progress, fd, element->d_name);
+    }
+
+    closedir(stream);
+}
+
+static void * scan(void *arg) {
+    struct progress *progress = (struct progress *)arg;
+
+    for (size_t i = 0; i < progress->paths_nums; i++) {
+        count_tree(progress, AT_FDCWD, progress->paths[i]);
+    }
+
+    /* a scan cut short by stop_progress() has no totals to show */
+    if (!atomic_load(&progress->is_stopped)) {
+        atomic_store(&progress->is_counted, true);
+    }
+    return NULL;
+}
+
+/* how long the rest takes at the average rate so far, by bytes if there are any */
+static void format_eta(const struct progress *progress, unsigned long long files, unsigned long long bytes,
+                       double seconds, char *buffer, size_t size) {
+    unsigned long long total_files = atomic_load(&progress->total_files), total_bytes = atomic_load(&progress->total_bytes);
+    double eta;
+    long left;
+
+    if (total_bytes > 0 && bytes > 0) {
+        eta = bytes < total_bytes ? (total_bytes - bytes) * seconds / bytes : 0;
+
+    } else if (files > 0) {
+        eta = files < total_files ? (total_files - files) * seconds / files : 0;
+
+    } else {
+        snprintf(buffer, size, "--:--");
+        return;
+    }
+
+    left = (long)eta;
+    if (left >= 3600) {
+        snprintf(buffer, size, "%ld:%02ld:%02ld", left / 3600, left / 60 % 60, left % 60);
+
+    } else {
+        snprintf(buffer, size, "%ld:%02ld", left / 60, left % 60);
+    }
+}
+
+/* called with progress->lock held, which guards the path */
+static void draw_progress(const struct progress *progress) {
+    unsigned long long files = atomic_load(&progress->files), bytes = atomic_load(&progress->bytes);
+    double seconds = get_seconds(&progress->start), mib = (double)(1 << 20);
+    double files_rate = seconds > 0 ? files / seconds : 0, bytes_rate = seconds > 0 ? bytes / seconds / mib : 0;
+    char eta[32];
+
+    if (progress->is_terminal) {
+        fputc('\r', stderr);
+    }
+
+    if (atomic_load(&progress->is_counted)) {
+        format_eta(progress, files, bytes, seconds, eta, sizeof (eta));
+        fprintf(stderr, "%s: %llu/%llu files, %.1f/%.1f MiB, %.0f files/s, %.1f MiB/s, ETA %s",
+                progress->name, files, atomic_load(&progress->total_files), bytes / mib,
+                atomic_load(&progress->total_bytes) / mib, files_rate, bytes_rate, eta);
+
+    } else {
+        fprintf(stderr, "%s: %llu files, %.1f MiB, %.0f files/s, %.1f MiB/s",
+                progress->name, files, bytes / mib, files_rate, bytes_rate);
+    }
+
+    if (progress->path[0] != '\0') {
+        fprintf(stderr, ", %s", progress->path);
+    }
+
+    fputs(progress->is_terminal ? "\033[K" : "\n", stderr);
+}
+
+/*  Redraw the line in place every PROGRESS_INTERVAL, or log one every LOG_INTERVALS of them
+ *  into a file or pipe, and ask the workers for a fresh path after each.
+ */
+static void * report(void *arg) {
+    struct progress *progress = (struct progress *)arg;
+    struct timespec deadline;
+    unsigned long ticks = 0;
+
+    pthread_mutex_lock(&progress->lock);
+    clock_gettime(CLOCK_MONOTONIC, &deadline);
+
+    while (!atomic_load(&progress->is_stopped)) {
+        deadline.tv_nsec += PROGRESS_INTERVAL * 1000000L;
+        if (deadline.tv_nsec >= 1000000000L) {
+            deadline.tv_sec++;
+            deadline.tv_nsec -= 1000000000L;
+        }
+
+        if (pthread_cond_timedwait(&progress->cond, &progress->lock, &deadline) != ETIMEDOUT ||
+            atomic_load(&progress->is_stopped)) {
+            continue;
+        }
+
+        if (progress->is_terminal || ++ticks % LOG_INTERVALS == 0) {
+            draw_progress(progress);
+        }
+        atomic_store(&progress->wants_path, true);
+    }
+
+    pthread_mutex_unlock(&progress->lock);
+    return NULL;
+}
+
+/* with is_shown, the reporter thread draws the progress line on stderr until stop_progress() */
+extern void start_progress(struct progress *progress, const char *name, bool is_shown) {
+    pthread_condattr_t attribute;
+
+    progress->name = name;
+    progress->is_shown = is_shown;
+    progress->is_terminal = isatty(STDERR_FILENO);
+    progress->is_scanning = false;
+    progress->path[0] = '\0';
+    atomic_init(&progress->files, 0);
+    atomic_init(&progress->bytes, 0);
+    atomic_init(&progress->total_files, 0);
+    atomic_init(&progress->total_bytes, 0);
+    atomic_init(&progress->is_counted, false);
+    atomic_init(&progress->wants_path, is_shown);
+    atomic_init(&progress->is_stopped, false);
+
+    pthread_mutex_init(&progress->lock, NULL);
+    pthread_condattr_init(&attribute);
+    pthread_condattr_setclock(&attribute, CLOCK_MONOTONIC);
+    pthread_cond_init(&progress->cond, &attribute);
+    pthread_condattr_destroy(&attribute);
+
+    clock_gettime(CLOCK_MONOTONIC, &progress->start);
+
+    if (is_shown) {
+        pthread_create(&progress->reporter, NULL, report, progress);
+    }
+}
+
+/* count the trees under paths beside the work, for the ETA; the paths must outlive the progress */
+extern void scan_progress_totals(struct progress *progress, char *paths[], size_t paths_nums) {
+    if (!progress->is_shown) {
+        return;
+    }
+
+    progress->paths = paths;
+    progress->paths_nums = paths_nums;
+    progress->is_scanning = pthread_create(&progress->scanner, NULL, scan, progress) == 0;
+}
+
+/* for work whose totals are known without a scan */
+extern void set_progress_totals(struct progress *progress, unsigned long long files, unsigned long long bytes) {
+    atomic_store(&progress->total_files, files);
+    atomic_store(&progress->total_bytes, bytes);
+    atomic_store(&progress->is_counted, true);
+}
+
+extern void count_progress(struct progress *progress, unsigned long long files, unsigned long long bytes) {
+    atomic_fetch_add_explicit(&progress->files, files, memory_order_relaxed);
+    atomic_fetch_add_explicit(&progress->bytes, bytes, memory_order_relaxed);
+}
+
+/* only the first worker to pass by after a redraw copies its path, the tail of it if long */
+extern void show_progress_path(struct progress *progress, const char *path) {
+    size_t length;
+
+    if (!atomic_load_explicit(&progress->wants_path, memory_order_relaxed) ||
+        !atomic_exchange(&progress->wants_path, false)) {
+        return;
+    }
+
+    length = strlen(path);
+    pthread_mutex_lock(&progress->lock);
+    if (length > PROGRESS_PATH_LEN) {
+        snprintf(progress->path, sizeof (progress->path), "...%s", path + length - (PROGRESS_PATH_LEN - 3));
+
+    } else {
+        snprintf(progress->path, sizeof (progress->path), "%s", path);
+    }
+    pthread_mutex_unlock(&progress->lock);
+}
+
+/* stop the threads, and leave the final counts on the progress line */
+extern void stop_progress(struct progress *progress) {
+    pthread_mutex_lock(&progress->lock);
+    atomic_store(&progress->is_stopped, true);
+    pthread_cond_broadcast(&progress->cond);
+    pthread_mutex_unlock(&progress->lock);
+
+    if (progress->is_scanning) {
+        pthread_join(progress->scanner, NULL);
+        progress->is_scanning = false;
+    }
+
+    if (progress->is_shown) {
+        pthread_join(progress->reporter, NULL);
+        progress->path[0] = '\0';
+        draw_progress(progress);
+        if (progress->is_terminal) {
+            fputc('\n', stderr);
+        }
+    }
+
+    pthread_cond_destroy(&progress->cond);
+    pthread_mutex_destroy(&progress->lock);
+}
+
+extern void print_progress_stats(const struct progress *progress) {
+    unsigned long long files = atomic_load(&progress->files), bytes = atomic_load(&progress->bytes);
+    double seconds = get_seconds(&progress->start);
+
+    fprintf(stderr, "%s: %llu bytes from %llu files in %.3f s, %.0f files/s, %.1f MiB/s\n", progress->name,
+            bytes, files, seconds, seconds > 0 ? files / seconds : 0.0,
+            seconds > 0 ? bytes / seconds / (1 << 20) : 0.0);
+}
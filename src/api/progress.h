@@ -0,0 +1,49 @@
+#include <time.h>
+#include <pthread.h>
+#include <stdatomic.h>
+
+#include "bool.h"
+
+/* how often the progress line is redrawn, in milliseconds */
+#define PROGRESS_INTERVAL 100
+
+/* the tail of the current path that the progress line shows */
+#define PROGRESS_PATH_LEN 48
+
+/*  The counters of a long cp, rm or mv. The workers only add to the atomic counters, and copy
+ *  the current path only when the reporter thread asks for it by wants_path, so the hot loop
+ *  pays nothing else. The totals are found by a pre-scan that runs beside the work, or set up
+ *  front, and the ETA is shown once they are known; rm has none.
+ */
+typedef struct progress {
+    const char *name;
+    bool is_shown;
+    bool is_terminal;
+    struct timespec start;
+    atomic_ullong files, bytes;
+    atomic_ullong total_files, total_bytes;
+    atomic_bool is_counted;
+    atomic_bool wants_path;
+    atomic_bool is_stopped;
+    char path[PROGRESS_PATH_LEN + 1];
+    pthread_mutex_t lock;       /* of path, and of the reporter's sleep */
+    pthread_cond_t cond;
+    pthread_t reporter, scanner;
+    bool is_scanning;
+    char **paths;
+    size_t paths_nums;
+} progress;
+
+extern void start_progress(struct progress *progress, const char *name, bool is_shown);
+
+extern void scan_progress_totals(struct progress *progress, char *paths[], size_t paths_nums);
+
+extern void set_progress_totals(struct progress *progress, unsigned long long files, unsigned long long bytes);
+
+extern void count_progress(struct progress *progress, unsigned long long files, unsigned long long bytes);
+
+extern void show_progress_path(struct progress *progress, const char *path);
+
+extern void stop_progress(struct progress *progress);
+
+extern void print_progress_stats(const struct progress *progress);
@@ -0,0 +1,304 @@
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+#include "bool.h"
+#include "uring.h"
+
+/* the operations of each copy, which are also the low bits of user_data, the first four being linked */
+#define STEPS_PER_COPY 6
+
+#define CHAIN_STEPS 4
+
+#define STEP_BITS 3
+
+enum {
+    STEP_OPEN_SOURCE,
+    STEP_READ,
+    STEP_OPEN_DESTINATION,
+    STEP_WRITE,
+    STEP_CLOSE_SOURCE,
+    STEP_CLOSE_DESTINATION
+};
+
+/* two fixed file slots per copy, registered empty and filled by the direct openat */
+#define FILE_SLOTS (2 * URING_BATCH_SIZE)
+
+typedef struct uring {
+    int fd;
+    unsigned sq_entries;
+    unsigned *sq_head, *sq_tail, *sq_mask, *sq_array;
+    unsigned *cq_head, *cq_tail, *cq_mask;
+    struct io_uring_sqe *sqes;
+    struct io_uring_cqe *cqes;
+    void *sq_ring, *cq_ring;
+    size_t sq_ring_size, cq_ring_size, sqes_size;
+    char *buffer;
+} uring;
+
+/* no liburing: the three system calls are all there is to it */
+static int uring_setup(unsigned entries, struct io_uring_params *params) {
+    return syscall(__NR_io_uring_setup, entries, params);
+}
+
+static int uring_enter(int fd, unsigned to_submit, unsigned min_complete, unsigned flags) {
+    return syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags, NULL, 0);
+}
+
+static int uring_register(int fd, unsigned opcode, void *arg, unsigned nr_args) {
+    return syscall(__NR_io_uring_register, fd, opcode, arg, nr_args);
+}
+
+/* every operation the chains use must be known to the kernel */
+static bool is_supported(int fd) {
+    const int opcodes[] = { IORING_OP_OPENAT, IORING_OP_READ, IORING_OP_WRITE, IORING_OP_CLOSE };
+    size_t size = sizeof (struct io_uring_probe) + 256 * sizeof (struct io_uring_probe_op);
+    struct io_uring_probe *probe = (struct io_uring_probe *)calloc(1, size);
+    bool retval = probe != NULL && uring_register(fd, IORING_REGISTER_PROBE, probe, 256) == 0;
+
+    for (size_t i = 0; retval && i < sizeof opcodes / sizeof opcodes[0]; i++) {
+        retval = opcodes[i] <= probe->last_op && (probe->ops[opcodes[i]].flags & IO_URING_OP_SUPPORTED);
+    }
+
+    free(probe);
+    return retval;
+}
+
+static struct io_uring_sqe * get_sqe(struct uring *ring, size_t index, int step, unsigned char opcode, unsigned char flags) {
+    unsigned tail = *ring->sq_tail;
+    unsigned slot = tail & *ring->sq_mask;
+    struct io_uring_sqe *sqe = &ring->sqes[slot];
+
+    memset(sqe, 0, sizeof *sqe);
+    sqe->opcode = opcode;
+    sqe->flags = flags;
+    sqe->user_data = ((unsigned long long)index << STEP_BITS) | step;
+    ring->sq_array[slot] = slot;
+    *ring->sq_tail = tail + 1;
+    return sqe;
+}
+
+/* submit the one prepared entry, and return the result of its completion */
+static int submit_one(struct uring *ring) {
+    unsigned head;
+    int result;
+
+    __atomic_store_n(ring->sq_tail, *ring->sq_tail, __ATOMIC_RELEASE);
+
+    if (uring_enter(ring->fd, 1, 1, IORING_ENTER_GETEVENTS) == -1 && errno != EINTR) {
+        return -errno;
+    }
+
+    while ((head = *ring->cq_head) == __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE)) {
+        if (uring_enter(ring->fd, 0, 1, IORING_ENTER_GETEVENTS) == -1 && errno != EINTR) return -errno;
+    }
+
+    result = ring->cqes[head & *ring->cq_mask].res;
+    __atomic_store_n(ring->cq_head, head + 1, __ATOMIC_RELEASE);
+    return result;
+}
+
+/*  The opcode probe cannot tell whether openat fills a fixed file slot, which came with
+ *  Linux 5.15; older kernels reject file_index, or ignore it and return a plain descriptor.
+ *  So open "/" into the first slot, and close the slot again only once it is known to be one,
+ *  since an older kernel would take the close for one of descriptor 0.
+ */
+static bool is_direct_open_supported(struct uring *ring) {
+    struct io_uring_sqe *sqe = get_sqe(ring, 0, STEP_OPEN_SOURCE, IORING_OP_OPENAT, 0);
+    int result;
+
+    sqe->fd = AT_FDCWD;
+    sqe->addr = (unsigned long)"/";
+    sqe->open_flags = O_RDONLY | O_DIRECTORY;
+    sqe->file_index = 1;
+
+    if ((result = submit_one(ring)) > 0) {
+        close(result);
+    }
+
+    if (result != 0) {
+        return false;
+    }
+
+    get_sqe(ring, 0, STEP_CLOSE_SOURCE, IORING_OP_CLOSE, 0)->file_index = 1;
+    return submit_one(ring) == 0;
+}
+
+/* return NULL if io_uring is not available, e.g. disabled by the kernel or a seccomp policy, or too old */
+extern struct uring * open_uring() {
+    struct io_uring_params params;
+    struct uring *ring;
+    int slots[FILE_SLOTS];
+
+    memset(&params, 0, sizeof params);
+    ring = (struct uring *)calloc(1, sizeof (struct uring));
+    if (ring == NULL || (ring->fd = uring_setup(URING_BATCH_SIZE * STEPS_PER_COPY, &params)) == -1) {
+        free(ring);
+        return NULL;
+    }
+
+    memset(slots, -1, sizeof slots);
+    if (!is_supported(ring->fd) || uring_register(ring->fd, IORING_REGISTER_FILES, slots, FILE_SLOTS) == -1) {
+        close(ring->fd);
+        free(ring);
+        return NULL;
+    }
+
+    ring->sq_entries = params.sq_entries;
+    ring->sq_ring_size = params.sq_off.array + params.sq_entries * sizeof (unsigned);
+    ring->cq_ring_size = params.cq_off.cqes + params.cq_entries * sizeof (struct io_uring_cqe);
+    ring->sqes_size = params.sq_entries * sizeof (struct io_uring_sqe);
+
+    if (params.features & IORING_FEAT_SINGLE_MMAP) {
+        if (ring->cq_ring_size > ring->sq_ring_size) ring->sq_ring_size = ring->cq_ring_size;
+        ring->cq_ring_size = ring->sq_ring_size;
+    }
+
+    ring->sq_ring = mmap(NULL, ring->sq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQ_RING);
+    ring->cq_ring = (params.features & IORING_FEAT_SINGLE_MMAP) ? ring->sq_ring :
+                    mmap(NULL, ring->cq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_CQ_RING);
+    ring->sqes = (struct io_uring_sqe *)mmap(NULL, ring->sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQES);
+    ring->buffer = (char *)malloc((size_t)URING_BATCH_SIZE * URING_MAX_FILE_SIZE);
+
+    if (ring->sq_ring == MAP_FAILED || ring->cq_ring == MAP_FAILED || ring->sqes == MAP_FAILED || ring->buffer == NULL) {
+        close_uring(ring);
+        return NULL;
+    }
+
+    ring->sq_head = (unsigned *)((char *)ring->sq_ring + params.sq_off.head);
+    ring->sq_tail = (unsigned *)((char *)ring->sq_ring + params.sq_off.tail);
+    ring->sq_mask = (unsigned *)((char *)ring->sq_ring + params.sq_off.ring_mask);
+    ring->sq_array = (unsigned *)((char *)ring->sq_ring + params.sq_off.array);
+    ring->cq_head = (unsigned *)((char *)ring->cq_ring + params.cq_off.head);
+    ring->cq_tail = (unsigned *)((char *)ring->cq_ring + params.cq_off.tail);
+    ring->cq_mask = (unsigned *)((char *)ring->cq_ring + params.cq_off.ring_mask);
+    ring->cqes = (struct io_uring_cqe *)((char *)ring->cq_ring + params.cq_off.cqes);
+
+    if (!is_direct_open_supported(ring)) {
+        close_uring(ring);
+        return NULL;
+    }
+
+    return ring;
+}
+
+/*  The chain of each file is linked, so that the kernel runs the steps in order, and stops
+ *  at the first failure, short reads and writes included.
+ */
+static void prepare_copy(struct uring *ring, struct uring_copy *copy, size_t index) {
+    struct io_uring_sqe *sqe;
+    char *buffer = ring->buffer + index * URING_MAX_FILE_SIZE;
+    unsigned source_slot = 2 * index, destination_slot = 2 * index + 1;
+
+    sqe = get_sqe(ring, index, STEP_OPEN_SOURCE, IORING_OP_OPENAT, IOSQE_IO_LINK);
+    sqe->fd = AT_FDCWD;
+    sqe->addr = (unsigned long)copy->source_path;
+    sqe->open_flags = O_RDONLY;
+    sqe->file_index = source_slot + 1;
+
+    sqe = get_sqe(ring, index, STEP_READ, IORING_OP_READ, IOSQE_IO_LINK | IOSQE_FIXED_FILE);
+    sqe->fd = source_slot;
+    sqe->addr = (unsigned long)buffer;
+    sqe->len = copy->size;
+
+    sqe = get_sqe(ring, index, STEP_OPEN_DESTINATION, IORING_OP_OPENAT, IOSQE_IO_LINK);
+    sqe->fd = AT_FDCWD;
+    sqe->addr = (unsigned long)copy->destination_path;
+    sqe->open_flags = O_CREAT | O_WRONLY | O_TRUNC;
+    sqe->len = copy->mode;
+    sqe->file_index = destination_slot + 1;
+
+    sqe = get_sqe(ring, index, STEP_WRITE, IORING_OP_WRITE, IOSQE_FIXED_FILE);
+    sqe->fd = destination_slot;
+    sqe->addr = (unsigned long)buffer;
+    sqe->len = copy->size;
+}
+
+/* a slot left empty by a broken chain fails to close with -EBADF, which is of no matter */
+static void prepare_close(struct uring *ring, size_t index) {
+    get_sqe(ring, index, STEP_CLOSE_SOURCE, IORING_OP_CLOSE, 0)->file_index = 2 * index + 1;
+    get_sqe(ring, index, STEP_CLOSE_DESTINATION, IORING_OP_CLOSE, 0)->file_index = 2 * index + 2;
+}
+
+static void complete_step(struct uring_copy *copy, int step, int result) {
+    if (copy->result != 0 || step == STEP_CLOSE_SOURCE || step == STEP_CLOSE_DESTINATION) {
+        return;
+    }
+
+    if (result < 0) {
+        copy->result = result;
+
+    } else if ((step == STEP_READ || step == STEP_WRITE) && result != copy->size) {
+        copy->result = -EIO;
+    }
+}
+
+/* submit the prepared entries, and reap all of their completions; return -1 if the ring broke */
+static int submit_and_wait(struct uring *ring, struct uring_copy *copies, size_t expected) {
+    size_t completed = 0;
+    unsigned head, tail;
+    struct io_uring_cqe *cqe;
+
+    __atomic_store_n(ring->sq_tail, *ring->sq_tail, __ATOMIC_RELEASE);
+
+    if (uring_enter(ring->fd, expected, expected, IORING_ENTER_GETEVENTS) == -1 && errno != EINTR) {
+        return -1;
+    }
+
+    while (completed < expected) {
+        head = *ring->cq_head;
+        tail = __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE);
+
+        if (head == tail) {
+            if (uring_enter(ring->fd, 0, 1, IORING_ENTER_GETEVENTS) == -1 && errno != EINTR) return -1;
+            continue;
+        }
+
+        for (; head != tail; head++, completed++) {
+            cqe = &ring->cqes[head & *ring->cq_mask];
+            complete_step(&copies[cqe->user_data >> STEP_BITS], cqe->user_data & ((1 << STEP_BITS) - 1), cqe->res);
+        }
+        __atomic_store_n(ring->cq_head, head, __ATOMIC_RELEASE);
+    }
+
+    return 0;
+}
+
+/*  Copy up to URING_BATCH_SIZE files, all of them no larger than URING_MAX_FILE_SIZE, and store
+ *  the result of each. Return -1 if the ring itself broke, and should not be used again.
+ *  The chains of the whole batch go in with one io_uring_enter(), and the closes of all of
+ *  the slots with a second one, once no chain can still be using them.
+ */
+extern int copy_files_by_uring(struct uring *ring, struct uring_copy *copies, size_t copies_nums) {
+    int retval;
+
+    for (size_t i = 0; i < copies_nums; i++) {
+        copies[i].result = 0;
+        prepare_copy(ring, &copies[i], i);
+    }
+    retval = submit_and_wait(ring, copies, copies_nums * CHAIN_STEPS);
+
+    for (size_t i = 0; i < copies_nums; i++) {
+        prepare_close(ring, i);
+    }
+    retval |= submit_and_wait(ring, copies, copies_nums * (STEPS_PER_COPY - CHAIN_STEPS));
+
+    for (size_t i = 0; retval == -1 && i < copies_nums; i++) {
+        copies[i].result = -EIO;
+    }
+
+    return retval;
+}
+
+extern void close_uring(struct uring *ring) {
+    if (ring->sqes != NULL && ring->sqes != MAP_FAILED) munmap(ring->sqes, ring->sqes_size);
+    if (ring->cq_ring != NULL && ring->cq_ring != MAP_FAILED && ring->cq_ring != ring->sq_ring) munmap(ring->cq_ring, ring->cq_ring_size);
+    if (ring->sq_ring != NULL && ring->sq_ring != MAP_FAILED) munmap(ring->sq_ring, ring->sq_ring_size);
+    free(ring->buffer);
+    close(ring->fd);
+    free(ring);
+}
@@ -0,0 +1,26 @@
+#include <sys/types.h>
+
+/* how many files a batch holds, and the largest file that fits in a slot of its buffer */
+#define URING_BATCH_SIZE 64
+
+#define URING_MAX_FILE_SIZE (64 << 10)
+
+/*  A copy of one small file, done by a linked chain of openat, read, openat, write on fixed
+ *  file slots. result is 0 on success and a negative errno otherwise, in which case nothing
+ *  is known about the destination, and the caller copies the file the usual way.
+ */
+typedef struct uring_copy {
+    const char *source_path;
+    const char *destination_path;
+    mode_t mode;
+    off_t size;
+    int result;
+} uring_copy;
+
+typedef struct uring uring;
+
+extern struct uring * open_uring();
+
+extern int copy_files_by_uring(struct uring *ring, struct uring_copy *copies, size_t copies_nums);
+
+extern void close_uring(struct uring *ring);
@@ -1,95 +1,578 @@
+#define _GNU_SOURCE
 #include <ctype.h>
+#include <errno.h>
 #include <stdint.h>
 #include <unistd.h>
 #include <fcntl.h>
 #include <err.h>
+#include <time.h>
+#include <sys/stat.h>
+#include <sys/sendfile.h>
+#include <sys/uio.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#endif
 #include "../api/entry.h"
+#include "../api/copy.h"
 
+/* the most bytes moved by one copy_file_range(), sendfile() or splice() */
+#define TRANSFER_CHUNK_SIZE (1 << 20)
 
-static int read_bytes_split_by(int fd, void *buffer, 
-                            size_t max_len, int8_t delimiter) {
-    int8_t byte_buf;
-    size_t count = 0;
-    while (read(fd, &byte_buf, sizeof(byte_buf)) != 0 && count < max_len) {
-        *(int8_t *)buffer++ = byte_buf;
-        count++;
-        if (byte_buf == delimiter) {
-            break;
+/* the size of both the input buffer and the output buffer */
+#define STREAM_BUFFER_SIZE (128 * 1024)
+
+/* how many of the following files are opened, and read ahead by the kernel, while one streams */
+#define READAHEAD_FILES 8
+
+/* how much of each file is read ahead, which covers small shards entirely */
+#define READAHEAD_SIZE (4 << 20)
+
+/* with -s, how many whitespace chars to hold back to find out whether the line is blank */
+#define PENDING_MAX_SIZE 4096
+
+/* runs of input at least this long are written straight from the input buffer rather than copied */
+#define REFERENCE_MIN_LEN 256
+
+/* the most segments gathered by one writev() */
+#define OUTPUT_IOV_COUNT 1024
+
+/* wide enough for an unsigned long, the padding, and the trailing tab */
+#define LINE_NUMBER_MAX_LEN 24
+
+static int8_t input_buffer[STREAM_BUFFER_SIZE];
+
+/* bytes read from all the sources, for --stats */
+static unsigned long long total_bytes = 0;
+
+/* set from --direct and --nocache in main(), which hand the plain streaming to the shared copy engine */
+static struct copy_options copy_stream_options;
+
+/*  The output is gathered into output_iov, whose segments either reference runs of
+ *  input_buffer, or short bytes copied into output_buffer, and thus it has to be flushed
+ *  before input_buffer is read into again.
+ */
+static int8_t output_buffer[STREAM_BUFFER_SIZE];
+
+static size_t output_len = 0;
+
+static struct iovec output_iov[OUTPUT_IOV_COUNT];
+
+static int output_iov_count = 0;
+
+/* "     1\t" as in GNU cat, incremented in place rather than formatted for every line */
+static char line_number[LINE_NUMBER_MAX_LEN];
+
+static size_t line_number_len = 0;
+
+
+static int write_bytes(int fd, const void *buffer, size_t len) {
+    const int8_t *p = buffer;
+    ssize_t nbytes;
+
+    while (len > 0) {
+        if ((nbytes = write(fd, p, len)) == -1) {
+            if (errno == EINTR) continue;
+            return -1;
         }
+        p += nbytes;
+        len -= nbytes;
     }
-    return count;
+    return 0;
 }
 
 
-static bool is_whitespace_line(int8_t *line, size_t len) {
-    for (int8_t *p = line; p < line + len; p++) {
-        if (!isspace(*p)) {
-            return false;
+static int flush_output() {
+    struct iovec *iov = output_iov;
+    int iov_count = output_iov_count, retval = 0;
+    ssize_t nbytes;
+
+    while (iov_count > 0) {
+        if ((nbytes = writev(fileno(stdout), iov, iov_count)) == -1) {
+            if (errno == EINTR) continue;
+            retval = -1;
+            break;
+        }
+
+        while (iov_count > 0 && (size_t)nbytes >= iov->iov_len) {
+            nbytes -= iov->iov_len;
+            iov++;
+            iov_count--;
+        }
+
+        if (iov_count > 0) {
+            iov->iov_base = (int8_t *)iov->iov_base + nbytes;
+            iov->iov_len -= nbytes;
         }
     }
-    return true;
+
+    output_len = 0;
+    output_iov_count = 0;
+    return retval;
 }
 
 
-static int show_source(struct entry *file, const int option[]) {
-    int fd;
-    int8_t line_buf[MAX_LEN];
-    int line_number = 1, empty_line_count = 0;
+static void put_segment(const void *bytes, size_t len) {
+    if (output_iov_count == OUTPUT_IOV_COUNT) {
+        flush_output();
+    }
+    output_iov[output_iov_count].iov_base = (void *)bytes;
+    output_iov[output_iov_count].iov_len = len;
+    output_iov_count++;
+}
+
+
+static void put_bytes(const void *bytes, size_t len) {
+    struct iovec *last;
+
+    if (output_len + len > sizeof (output_buffer)) {
+        flush_output();
+    }
+
+    memcpy(output_buffer + output_len, bytes, len);
+    last = &output_iov[output_iov_count > 0 ? output_iov_count - 1 : 0];
+
+    /* extend the last segment if it ends right where the bytes are copied */
+    if (output_iov_count > 0 && (int8_t *)last->iov_base + last->iov_len == output_buffer + output_len) {
+        last->iov_len += len;
+
+    } else {
+        put_segment(output_buffer + output_len, len);
+    }
+
+    output_len += len;
+}
+
+
+static void put_input(const int8_t *bytes, size_t len) {
+    if (len >= REFERENCE_MIN_LEN) {
+        put_segment(bytes, len);
+
+    } else if (len > 0) {
+        put_bytes(bytes, len);
+    }
+}
+
 
-    if (strcmp(file->received_path, "-") == 0) {
-        fd = fileno(stdin);
+static void increase_line_number() {
+    char *p = line_number + line_number_len - 2;
 
-    } else if ((fd = open(file->received_path, O_RDONLY)) == -1) {
-        warn("cannot access file '%s'", file->received_path);
+    while (p >= line_number && *p == '9') {
+        *p-- = '0';
+    }
+
+    if (p >= line_number && *p != ' ') {
+        *p += 1;
+
+    } else if (p >= line_number) {
+        *p = '1';
+
+    } else {
+        memmove(line_number + 1, line_number, line_number_len);
+        *line_number = '1';
+        line_number_len += 1;
+    }
+}
+
+
+static ssize_t transfer_by_copy_file_range(int fd) {
+    return copy_file_range(fd, NULL, fileno(stdout), NULL, TRANSFER_CHUNK_SIZE, 0);
+}
+
+
+static ssize_t transfer_by_sendfile(int fd) {
+    return sendfile(fileno(stdout), fd, NULL, TRANSFER_CHUNK_SIZE);
+}
+
+
+static ssize_t transfer_by_splice(int fd) {
+    return splice(fd, NULL, fileno(stdout), NULL, TRANSFER_CHUNK_SIZE, SPLICE_F_MOVE | SPLICE_F_MORE);
+}
+
+
+/*  Move the bytes from fd to stdout without copying them into user space.
+ *  It returns 1 if the kernel does not support the method for the pair before anything
+ *  is transferred, so that the caller can try the next one.
+ */
+static int transfer_source(int fd, ssize_t (*transfer)(int)) {
+    ssize_t nbytes;
+    bool transferred = false;
+
+    while ((nbytes = transfer(fd)) > 0) {
+        transferred = true;
+        total_bytes += nbytes;
+    }
+
+    if (nbytes == -1) {
+        if (!transferred && (errno == EINVAL || errno == EXDEV || errno == ENOSYS ||
+                             errno == EBADF || errno == EOPNOTSUPP)) {
+            return 1;
+        }
         return -1;
     }
 
-    int line_whitespace_flag = false;
-    int nbytes = 0;
-    while ((nbytes = read_bytes_split_by(fd, line_buf, sizeof(line_buf), '\n')) != 0) {
-        if (option['s'] == 1) {
-            if (is_whitespace_line(line_buf, nbytes)) {
-                if (!line_whitespace_flag) {
-                    line_whitespace_flag = true;
-                } else {
-                    continue;
-                }
-            } else {
-                line_whitespace_flag = false;
-            }
+    return 0;
+}
+
+
+/*  Without formatting options, try copy_file_range(), sendfile() and splice() in turn,
+ *  and fall back to a read and write loop with large buffer.
+ *
+ *  The first two are only tried on regular files with non-zero size, since files in /proc
+ *  and /sys report zero size, and some kernels transfer nothing for them.
+ */
+static int stream_source(int fd) {
+    struct stat attribute;
+    ssize_t nbytes;
+    int retval = 1;
+    enum copy_method method;
+    off_t bytes;
+
+    if (copy_stream_options.is_direct || copy_stream_options.is_nocache) {
+        retval = copy_stream(fd, fileno(stdout), &copy_stream_options, &method, &bytes);
+        total_bytes += bytes;
+        return retval;
+    }
+
+    if (fstat(fd, &attribute) == 0 && S_ISREG(attribute.st_mode) && attribute.st_size > 0) {
+        if ((retval = transfer_source(fd, transfer_by_copy_file_range)) == 1) {
+            retval = transfer_source(fd, transfer_by_sendfile);
         }
+    }
+
+    if (retval == 1) {
+        retval = transfer_source(fd, transfer_by_splice);
+    }
+
+    if (retval != 1) {
+        return retval;
+    }
+
+    while ((nbytes = read(fd, input_buffer, sizeof (input_buffer))) != 0) {
+        if (nbytes == -1) {
+            if (errno == EINTR) continue;
+            return -1;
+        }
+        total_bytes += nbytes;
+        if (write_bytes(fileno(stdout), input_buffer, nbytes) == -1) {
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+
+typedef const int8_t * (*scan_function)(const int8_t *p, const int8_t *end, int8_t a, int8_t b);
+
+/* find the first byte equal to a or b, or return end */
+static const int8_t * scan_scalar(const int8_t *p, const int8_t *end, int8_t a, int8_t b) {
+    for (; p < end; p++) {
+        if (*p == a || *p == b) return p;
+    }
+    return end;
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+
+__attribute__((target("sse2")))
+static const int8_t * scan_sse2(const int8_t *p, const int8_t *end, int8_t a, int8_t b) {
+    __m128i va = _mm_set1_epi8(a), vb = _mm_set1_epi8(b);
+
+    for (; p + 16 <= end; p += 16) {
+        __m128i v = _mm_loadu_si128((const __m128i *)p);
+        int mask = _mm_movemask_epi8(_mm_or_si128(_mm_cmpeq_epi8(v, va), _mm_cmpeq_epi8(v, vb)));
+        if (mask != 0) return p + __builtin_ctz(mask);
+    }
+
+    return scan_scalar(p, end, a, b);
+}
+
+__attribute__((target("avx2")))
+static const int8_t * scan_avx2(const int8_t *p, const int8_t *end, int8_t a, int8_t b) {
+    __m256i va = _mm256_set1_epi8(a), vb = _mm256_set1_epi8(b);
+
+    for (; p + 64 <= end; p += 64) {
+        __m256i v0 = _mm256_loadu_si256((const __m256i *)p);
+        __m256i v1 = _mm256_loadu_si256((const __m256i *)(p + 32));
+        __m256i m0 = _mm256_or_si256(_mm256_cmpeq_epi8(v0, va), _mm256_cmpeq_epi8(v0, vb));
+        __m256i m1 = _mm256_or_si256(_mm256_cmpeq_epi8(v1, va), _mm256_cmpeq_epi8(v1, vb));
+        uint64_t mask = (uint32_t)_mm256_movemask_epi8(m0) | ((uint64_t)(uint32_t)_mm256_movemask_epi8(m1) << 32);
+        if (mask != 0) return p + __builtin_ctzll(mask);
+    }
 
-        for (size_t i = 0; i < nbytes; i++) {
-            if (option['e'] == 1 && line_buf[i] == '\n') {
-                fputc('$', stdout);
+    return scan_sse2(p, end, a, b);
+}
+
+#endif
+
+static scan_function scan_special = scan_scalar;
+
+/* choose the widest scanner the CPU supports at runtime */
+static void load_scan_function() {
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) {
+        scan_special = scan_avx2;
+
+    } else if (__builtin_cpu_supports("sse2")) {
+        scan_special = scan_sse2;
+    }
+#endif
+}
+
+
+typedef struct format_state {
+    bool line_start;        /* nothing of the current line is written yet */
+    bool line_blank;        /* the current line consists of whitespace only so far */
+    bool previous_blank;    /* the previous written line is blank, for -s */
+    int8_t pending[PENDING_MAX_SIZE];
+    size_t pending_len;
+} format_state;
+
+
+/* with -n, or -b if the line is not empty, prefix the first segment of each line with its number */
+static void begin_line(struct format_state *state, bool empty, const int option[]) {
+    if (!state->line_start) {
+        return;
+    }
+
+    state->line_start = false;
+
+    if (option['b'] == 1 ? !empty : option['n'] == 1) {
+        put_bytes(line_number, line_number_len);
+        increase_line_number();
+    }
+}
+
+
+static void end_line(struct format_state *state, const int option[]) {
+    put_bytes(option['e'] == 1 ? "$\n" : "\n", option['e'] == 1 ? 2 : 1);
+    state->line_start = true;
+    state->line_blank = true;
+}
+
+
+/* the whitespace at the beginning of lines is short, and thus formatted byte by byte */
+static void put_whitespace(const int8_t *p, const int8_t *end, const int option[]) {
+    for (; p < end; p++) {
+        if (option['t'] == 1 && *p == '\t') {
+            put_bytes("^I", 2);
+        } else {
+            put_bytes(p, 1);
+        }
+    }
+}
+
+
+/*  With -s, a line is blank if it consists of whitespace only, and any blank line following
+ *  another blank line is dropped. Only the leading whitespace of a line needs inspection, which
+ *  is scanned byte by byte here. It is held back in pending if the line follows a blank one,
+ *  until it turns out whether the line is blank.
+ *
+ *  Returns where the rest of the line, if any, begins.
+ */
+static const int8_t * format_leading_whitespace(struct format_state *state, const int8_t *p,
+                                                const int8_t *end, const int option[]) {
+    const int8_t *q = p;
+    while (q < end && *q != '\n' && isspace(*q)) q++;
+
+    if (state->previous_blank) {
+        if (q == end) {
+            if (state->pending_len + (q - p) <= sizeof (state->pending)) {
+                memcpy(state->pending + state->pending_len, p, q - p);
+                state->pending_len += q - p;
+                return q;
             }
-        
-            if (option['t'] == 1 && line_buf[i] == '\t') {
-                fputs("^I", stdout);
+            /* too long to hold back, so the line is never dropped */
+            state->previous_blank = false;
+
+        } else if (*q == '\n') {
+            state->pending_len = 0;
+            return q + 1;
+        }
+
+        begin_line(state, false, option);
+        put_whitespace(state->pending, state->pending + state->pending_len, option);
+        state->pending_len = 0;
+
+    } else {
+        begin_line(state, q < end && q == p && *q == '\n', option);
+    }
+
+    put_whitespace(p, q, option);
+
+    if (q < end && *q == '\n') {
+        end_line(state, option);
+        state->previous_blank = true;
+        return q + 1;
+    }
+
+    if (q < end) {
+        state->line_blank = false;
+        state->previous_blank = false;
+    }
+
+    return q;
+}
+
+
+/*  Scan each chunk for newline (and tab with -t) with SIMD, gathering the runs between them
+ *  straight from the input buffer, and the inserted "$", "^I" and line numbers from the
+ *  output buffer, into a single writev() per read. Interactive input is still echoed line by line.
+ */
+static int format_source(int fd, const int option[]) {
+    struct format_state state;
+    int8_t tab = option['t'] == 1 ? '\t' : '\n';
+    ssize_t nbytes;
+
+    state.line_start = true;
+    state.line_blank = true;
+    state.previous_blank = false;
+    state.pending_len = 0;
+
+    while ((nbytes = read(fd, input_buffer, sizeof (input_buffer))) != 0) {
+        const int8_t *p = input_buffer, *end = input_buffer + nbytes, *q;
+
+        if (nbytes == -1) {
+            if (errno == EINTR) continue;
+            return -1;
+        }
+
+        total_bytes += nbytes;
+
+        while (p < end) {
+            if (option['s'] == 1 && state.line_blank) {
+                p = format_leading_whitespace(&state, p, end, option);
                 continue;
             }
 
-            fputc(line_buf[i], stdout);
+            q = scan_special(p, end, '\n', tab);
+
+            if (q > p) {
+                begin_line(&state, false, option);
+                put_input(p, q - p);
+            }
+
+            if (q == end) {
+                break;
+            }
+
+            if (*q == '\t') {
+                begin_line(&state, false, option);
+                put_bytes("^I", 2);
+
+            } else {
+                begin_line(&state, q == p, option);
+                end_line(&state, option);
+                state.previous_blank = false;
+            }
+
+            p = q + 1;
+        }
+
+        if (flush_output() == -1) {
+            return -1;
         }
     }
+
     return 0;
 }
 
 
+typedef struct source {
+    const char *path;
+    int fd;
+    int error;      /* errno of open(), reported when the source takes its turn */
+} source;
+
+
+/* open the source, and ask the kernel to read ahead its beginning in the background */
+static void open_source(struct source *source, const char *path) {
+    source->path = path;
+    source->error = 0;
+
+    if (strcmp(path, "-") == 0) {
+        source->fd = fileno(stdin);
+
+    } else if ((source->fd = open(path, O_RDONLY)) == -1) {
+        source->error = errno;
+
+    } else {
+        posix_fadvise(source->fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+        if (!copy_stream_options.is_direct) {
+            posix_fadvise(source->fd, 0, READAHEAD_SIZE, POSIX_FADV_WILLNEED);
+        }
+    }
+}
+
+
+static int show_source(struct source *source, const int option[]) {
+    int retval;
+
+    if (source->fd == -1) {
+        errno = source->error;
+        warn("cannot access file '%s'", source->path);
+        return -1;
+    }
+
+    if (option['e'] == 0 && option['t'] == 0 && option['s'] == 0 && option['n'] == 0 && option['b'] == 0) {
+        retval = stream_source(source->fd);
+
+    } else {
+        retval = format_source(source->fd, option);
+
+        /* formatting reads through the page cache, so --direct only drops what was read, like --nocache */
+        if (copy_stream_options.is_direct || copy_stream_options.is_nocache) {
+            posix_fadvise(source->fd, 0, 0, POSIX_FADV_DONTNEED);
+        }
+    }
+
+    if (retval == -1) {
+        warn("cannot read file '%s'", source->path);
+    }
+
+    if (source->fd != fileno(stdin)) {
+        close(source->fd);
+    }
+
+    return retval;
+}
+
+
+/*  Keep the next READAHEAD_FILES files open in a ring while the current one streams, so that
+ *  their first-byte latency on cold caches or network storage overlaps with the copying.
+ */
 static int show_sources(char *paths[], size_t paths_nums, const int option[]) {
+    struct source sources[READAHEAD_FILES + 1];
+    size_t opened_nums = 0;
     int retval = 0;
 
     for (size_t i = 0; i < paths_nums; i++) {
-        struct entry *entry = get_entries_chain(paths[i]);
-        retval |= show_source(entry, option);
-        if (i < paths_nums - 1) fputc('\n', stdout);
-        free_entry(entry);
+        while (opened_nums < paths_nums && opened_nums <= i + READAHEAD_FILES) {
+            open_source(&sources[opened_nums % (READAHEAD_FILES + 1)], paths[opened_nums]);
+            opened_nums++;
+        }
+
+        retval |= show_source(&sources[i % (READAHEAD_FILES + 1)], option);
+        if (i < paths_nums - 1) write_bytes(fileno(stdout), "\n", 1);
     }
 
     return retval;
 }
 
 
+static void print_stats(const struct timespec *start, size_t paths_nums) {
+    struct timespec end;
+    double seconds;
+
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    seconds = (end.tv_sec - start->tv_sec) + (end.tv_nsec - start->tv_nsec) / 1e9;
+
+    fprintf(stderr, "cat: %llu bytes from %zu files in %.3f s, %.1f MiB/s\n", total_bytes, paths_nums,
+            seconds, seconds > 0 ? total_bytes / seconds / (1 << 20) : 0.0);
+}
+
+
 static bool try_match_option(const char *arg, int *option_buf) {
     const char *p;
 
@@ -109,6 +592,21 @@ static bool try_match_option(const char *arg, int *option_buf) {
             } else if (strcmp(p, "show-tabs") == 0) {
                 option_buf['t'] = 1;
 
+            } else if (strcmp(p, "number") == 0) {
+                option_buf['n'] = 1;
+
+            } else if (strcmp(p, "number-nonblank") == 0) {
+                option_buf['b'] = 1;
+
+            } else if (strcmp(p, "stats") == 0) {
+                option_buf['S'] = 1;
+
+            } else if (strcmp(p, "direct") == 0) {
+                option_buf['D'] = 1;
+
+            } else if (strcmp(p, "nocache") == 0) {
+                option_buf['N'] = 1;
+
             } else {
                 die("cat: unknown options '--%s'", p);
             }
@@ -128,6 +626,12 @@ static bool try_match_option(const char *arg, int *option_buf) {
 
                 } else if (*p == 't' || *p == 'T') {
                     option_buf['t'] = 1;
+
+                } else if (*p == 'n') {
+                    option_buf['n'] = 1;
+
+                } else if (*p == 'b') {
+                    option_buf['b'] = 1;
                     
                 } else {
                     die("cat: unknown options -- '%c'", *p);
@@ -161,11 +665,23 @@ static void parse_argv(int argc, char *argv[], int *option_buf,
 
 
 int main(int argc, char *argv[], char *envp[]) {
-    int option[128];
+    int option[128], retval;
     char *paths[MAX_SIZE];
     size_t paths_nums;
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
     memset(option, 0, sizeof option);
     setbuf(stdout, NULL);
+    line_number_len = snprintf(line_number, sizeof (line_number), "%6d\t", 1);
+    load_scan_function();
     parse_argv(argc, argv, option, paths, &paths_nums);
-    return show_sources(paths, paths_nums, option);
+    /* the output is a stream, maybe one opened by >> with O_APPEND, and never gets holes */
+    copy_stream_options.sparse = SPARSE_NEVER;
+    copy_stream_options.is_direct = option['D'];
+    copy_stream_options.is_nocache = option['N'];
+    retval = show_sources(paths, paths_nums, option);
+    if (option['S'] == 1) {
+        print_stats(&start, paths_nums);
+    }
+    return retval;
 }
\ No newline at end of file
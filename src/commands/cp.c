@@ -1,20 +1,180 @@
 #include <unistd.h>
 #include <dirent.h>
 #include <fcntl.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+#include <stdatomic.h>
 #include <sys/stat.h>
 
 #include "../api/entry.h"
+#include "../api/copy.h"
+#include "../api/uring.h"
+#include "../api/progress.h"
+
+/* which copy method moved how many files and bytes, for --stats */
+static struct copy_stats stats;
+
+static pthread_mutex_t stats_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* the files and bytes done, for --progress */
+static struct progress copy_progress;
+
+/* set from the options in main() */
+static struct copy_options copy_stream_options;
+
+/* whether any of --preserve=mode,timestamps,ownership is given */
+static bool is_preserving(const int option[]) {
+    return option['M'] == 1 || option['T'] == 1 || option['O'] == 1;
+}
+
+/*  Apply the preserved attributes through the open fd, which spares the path lookups of
+ *  chmod() and alike. Ownership goes first, as chown clears the set-user-ID bits, and the
+ *  timestamps last, since writing changes them. Only root may give files away, so others
+ *  keep their own ownership quietly, like GNU cp.
+ */
+static int preserve_attributes(int fd, const struct stat *attribute, const int option[]) {
+    int retval = 0;
+    struct timespec times[2];
+
+    if (option['O'] == 1 && fchown(fd, attribute->st_uid, attribute->st_gid) == -1 && errno != EPERM) {
+        retval = -1;
+    }
+
+    if (option['M'] == 1) {
+        retval |= fchmod(fd, attribute->st_mode & 07777);
+    }
+
+    if (option['T'] == 1) {
+        times[0] = attribute->st_atim;
+        times[1] = attribute->st_mtim;
+        retval |= futimens(fd, times);
+    }
+
+    return retval;
+}
+
+static int copy_file(const struct entry *source, const struct entry *destination, const int option[]) {
+    int input_stream_fd, output_stream_fd, retval;
+    enum copy_method method;
+    off_t bytes;
+
+    if ((input_stream_fd = open(source->real_path, O_RDONLY)) == -1) {
+        log_error("cp: cannot open '%s' for reading", source->received_path);
+        return -1;
+    }
+
+    if ((output_stream_fd = open(destination->real_path, O_CREAT | O_WRONLY | O_TRUNC, source->attribute->st_mode)) == -1) {
+        log_error("cp: cannot create regular file '%s'", destination->received_path);
+        close(input_stream_fd);
+        return -1;
+    }
+
+    if ((retval = copy_stream(input_stream_fd, output_stream_fd, &copy_stream_options, &method, &bytes)) == -1) {
+        log_error("cp: error copying '%s' to '%s'", source->received_path, destination->received_path);
+
+    } else {
+        pthread_mutex_lock(&stats_lock);
+        record_copy(&stats, method, bytes);
+        pthread_mutex_unlock(&stats_lock);
+    }
+
+    if (retval == 0 && preserve_attributes(output_stream_fd, source->attribute, option) == -1) {
+        log_error("cp: cannot preserve attributes of '%s'", destination->received_path);
+        retval = -1;
+    }
 
-static int copy_file(const struct entry *source, const struct entry *destination) {
-    char buffer[MAX_LEN];
-    int input_stream_fd, output_stream_fd;
-    ssize_t nbytes;
-    input_stream_fd = open(source->real_path, O_RDONLY);
-    output_stream_fd = open(destination->real_path, O_CREAT | O_WRONLY, source->attribute->st_mode);
-    while ((nbytes = read(input_stream_fd, buffer, sizeof buffer)) && write(output_stream_fd, buffer, nbytes));
     close(input_stream_fd);
-    close(output_stream_fd);
-    return 0;
+    retval |= close(output_stream_fd);
+    return retval;
+}
+
+/* how many chains the table of hard-linked inodes has */
+#define INODE_BUCKETS 65536
+
+/*  Under --preserve=links, a file with more than one link is recorded by its (dev, ino) when it
+ *  is first copied, and its other names found later are link()ed to that copy. The record is
+ *  pending while the first copy is written, so that other workers wait for it under -j.
+ */
+typedef struct inode_link {
+    dev_t dev;
+    ino_t ino;
+    char *real_path;            /* the first copy, or NULL if that failed */
+    bool is_pending;
+    struct inode_link *next;
+} inode_link;
+
+static struct inode_link *inode_links[INODE_BUCKETS];
+
+static pthread_mutex_t inode_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static pthread_cond_t inode_cond = PTHREAD_COND_INITIALIZER;
+
+static size_t get_inode_bucket(dev_t dev, ino_t ino) {
+    unsigned long long hash = (unsigned long long)ino * 0x9e3779b97f4a7c15ULL ^ (unsigned long long)dev;
+    return (hash ^ (hash >> 32)) % INODE_BUCKETS;
+}
+
+static int link_or_copy_file(const struct entry *source, const struct entry *destination, const int option[]) {
+    const struct stat *attribute = source->attribute;
+    struct inode_link *record, **bucket;
+    char *real_path;
+    int retval;
+
+    if (option['L'] == 0 || attribute->st_nlink < 2) {
+        return copy_file(source, destination, option);
+    }
+
+    pthread_mutex_lock(&inode_lock);
+    bucket = &inode_links[get_inode_bucket(attribute->st_dev, attribute->st_ino)];
+    for (record = *bucket; record != NULL; record = record->next) {
+        if (record->dev == attribute->st_dev && record->ino == attribute->st_ino) break;
+    }
+
+    if (record == NULL) {
+        record = (struct inode_link *)malloc(sizeof (struct inode_link));
+        record->dev = attribute->st_dev;
+        record->ino = attribute->st_ino;
+        record->real_path = strdup(destination->real_path);
+        record->is_pending = true;
+        record->next = *bucket;
+        *bucket = record;
+        pthread_mutex_unlock(&inode_lock);
+
+        retval = copy_file(source, destination, option);
+
+        pthread_mutex_lock(&inode_lock);
+        record->is_pending = false;
+        if (retval == -1) {
+            free(record->real_path);
+            record->real_path = NULL;
+        }
+        pthread_cond_broadcast(&inode_cond);
+        pthread_mutex_unlock(&inode_lock);
+        return retval;
+    }
+
+    while (record->is_pending) {
+        pthread_cond_wait(&inode_cond, &inode_lock);
+    }
+    real_path = record->real_path != NULL ? strdup(record->real_path) : NULL;
+    pthread_mutex_unlock(&inode_lock);
+
+    if (real_path == NULL) {
+        return copy_file(source, destination, option);
+    }
+
+    if ((retval = link(real_path, destination->real_path)) == -1) {
+        log_error("cp: cannot create hard link '%s' to '%s'", destination->received_path, real_path);
+
+    } else {
+        pthread_mutex_lock(&stats_lock);
+        stats.linked_files++;
+        pthread_mutex_unlock(&stats_lock);
+    }
+
+    free(real_path);
+    return retval;
 }
 
 static int overwrite_file(const struct entry *source, const struct entry *destination, const int option[]) {
@@ -24,21 +184,64 @@ static int overwrite_file(const struct entry *source, const struct entry *destin
         fgetc(stdin);
         if (c != 'y') return 0;
     }
-    return unlink(destination->real_path) | copy_file(source, destination);
+    return unlink(destination->real_path) | link_or_copy_file(source, destination, option);
 }
 
-static int operate_file_once(const struct entry *file, const struct entry *destination, const int option[]) {
+/*  Under -u, the destination is left alone if it has the same size and is not older than the
+ *  source, or, with --checksum, if it has the same size and the same contents.
+ */
+static bool is_unchanged(const struct entry *source, const struct entry *destination, const int option[]) {
+    const struct stat *source_attribute = source->attribute, *destination_attribute = destination->attribute;
+    int input_stream_fd, output_stream_fd;
+    bool retval;
+
+    if (source_attribute->st_size != destination_attribute->st_size) {
+        return false;
+    }
+
+    if (option['c'] == 0) {
+        return destination_attribute->st_mtim.tv_sec > source_attribute->st_mtim.tv_sec ||
+               (destination_attribute->st_mtim.tv_sec == source_attribute->st_mtim.tv_sec &&
+                destination_attribute->st_mtim.tv_nsec >= source_attribute->st_mtim.tv_nsec);
+    }
+
+    if ((input_stream_fd = open(source->real_path, O_RDONLY)) == -1) {
+        return false;
+    }
+
+    if ((output_stream_fd = open(destination->real_path, O_RDONLY)) == -1) {
+        close(input_stream_fd);
+        return false;
+    }
+
+    posix_fadvise(input_stream_fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+    posix_fadvise(output_stream_fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+    retval = compare_streams(input_stream_fd, output_stream_fd) == 1;
+
+    close(input_stream_fd);
+    close(output_stream_fd);
+    return retval;
+}
+
+static int update_file(const struct entry *file, const struct entry *destination, const int option[]) {
     if (!is_entry_located(destination)) {
         if (!is_directory_write_permitted(destination->previous)) {
             log_error("cp: cannot access '%s': Permission denied", destination->previous->received_path);
             return -1;
         }
-        return copy_file(file, destination);
+        return link_or_copy_file(file, destination, option);
 
     } else if (!is_file(destination)) {
         log_error("cp: cannot overwrite directory '%s' with non-directory '%s'", destination->received_path, file->received_path);
         return -1;
 
+    } else if (option['u'] == 1 && is_unchanged(file, destination, option)) {
+        pthread_mutex_lock(&stats_lock);
+        stats.skipped_files++;
+        stats.skipped_bytes += file->attribute->st_size;
+        pthread_mutex_unlock(&stats_lock);
+        return 0;
+
     } else {
         if (!is_file_write_permitted(destination)) {
             log_error("cp: cannot access '%s': Permission denied", destination->received_path);
@@ -48,7 +251,171 @@ static int operate_file_once(const struct entry *file, const struct entry *desti
     }
 }
 
-static int copy_empty_directory(const struct entry *source, struct entry *destination) {
+/* copied, linked, skipped or failed, the file counts as done for --progress */
+static int operate_file_once(const struct entry *file, const struct entry *destination, const int option[]) {
+    int retval = update_file(file, destination, option);
+    count_progress(&copy_progress, 1, file->attribute->st_size);
+    return retval;
+}
+
+/* the upper bound of -j */
+#define MAX_JOBS 256
+
+/* how many tasks a worker's deque holds before it grows */
+#define DEQUE_INITIAL_CAPACITY 64
+
+/*  A directory copied under -j. Its final mode can only be applied after all of its children
+ *  are written, so it counts its own scan plus every unfinished child, file or subdirectory.
+ */
+typedef struct subtree {
+    char *real_path;            /* of the destination */
+    struct stat attribute;      /* of the source */
+    bool is_created;
+    atomic_size_t pending;
+    struct subtree *parent;
+} subtree;
+
+typedef struct task {
+    struct entry *source;
+    struct entry *destination;
+    struct subtree *subtree;    /* the directory to scan, or the parent of the file to copy */
+    bool is_directory;
+} task;
+
+/*  Each worker pushes and pops the tasks it finds at the tail of its own deque, which keeps the
+ *  walk depth first and cache friendly, while idle workers steal from the head of the others,
+ *  where the oldest tasks, and thus the largest subtrees, are.
+ */
+typedef struct worker {
+    pthread_t thread;
+    pthread_mutex_t lock;
+    struct task **tasks;
+    size_t head, tail, capacity;
+} worker;
+
+static struct worker *workers;
+
+static int workers_nums;
+
+static const int *pool_option;
+
+static __thread struct worker *current_worker;
+
+/* tasks in the deques, and tasks either queued or running */
+static atomic_size_t queued_tasks, outstanding_tasks;
+
+static atomic_size_t idle_workers;
+
+static atomic_int pool_retval;
+
+static pthread_mutex_t idle_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static pthread_cond_t idle_cond = PTHREAD_COND_INITIALIZER;
+
+static void push_task(struct entry *source, struct entry *destination, struct subtree *subtree, bool is_directory) {
+    struct worker *worker = current_worker != NULL ? current_worker : &workers[0];
+    struct task *task = (struct task *)malloc(sizeof (struct task));
+    task->source = source;
+    task->destination = destination;
+    task->subtree = subtree;
+    task->is_directory = is_directory;
+
+    atomic_fetch_add(&outstanding_tasks, 1);
+
+    pthread_mutex_lock(&worker->lock);
+    if (worker->tail == worker->capacity) {
+        memmove(worker->tasks, worker->tasks + worker->head, (worker->tail - worker->head) * sizeof (struct task *));
+        worker->tail -= worker->head;
+        worker->head = 0;
+        if (worker->tail == worker->capacity) {
+            worker->capacity *= 2;
+            worker->tasks = (struct task **)realloc(worker->tasks, worker->capacity * sizeof (struct task *));
+        }
+    }
+    worker->tasks[worker->tail++] = task;
+    atomic_fetch_add(&queued_tasks, 1);
+    pthread_mutex_unlock(&worker->lock);
+
+    if (atomic_load(&idle_workers) > 0) {
+        pthread_mutex_lock(&idle_lock);
+        pthread_cond_signal(&idle_cond);
+        pthread_mutex_unlock(&idle_lock);
+    }
+}
+
+static struct task * pop_task(struct worker *worker) {
+    struct task *task = NULL;
+
+    pthread_mutex_lock(&worker->lock);
+    if (worker->head < worker->tail) {
+        task = worker->tasks[--worker->tail];
+        atomic_fetch_sub(&queued_tasks, 1);
+    }
+    pthread_mutex_unlock(&worker->lock);
+
+    return task;
+}
+
+static struct task * steal_task(struct worker *thief) {
+    struct worker *worker;
+    struct task *task = NULL;
+    int index = thief - workers;
+
+    for (int i = 1; i < workers_nums && task == NULL; i++) {
+        worker = &workers[(index + i) % workers_nums];
+        pthread_mutex_lock(&worker->lock);
+        if (worker->head < worker->tail) {
+            task = worker->tasks[worker->head++];
+            atomic_fetch_sub(&queued_tasks, 1);
+        }
+        pthread_mutex_unlock(&worker->lock);
+    }
+
+    return task;
+}
+
+/* sleep until some task is queued, and return true if all of the tasks are done instead */
+static bool wait_for_tasks() {
+    bool is_done;
+
+    pthread_mutex_lock(&idle_lock);
+    atomic_fetch_add(&idle_workers, 1);
+    while (atomic_load(&queued_tasks) == 0 && atomic_load(&outstanding_tasks) > 0) {
+        pthread_cond_wait(&idle_cond, &idle_lock);
+    }
+    atomic_fetch_sub(&idle_workers, 1);
+    is_done = atomic_load(&outstanding_tasks) == 0;
+    pthread_mutex_unlock(&idle_lock);
+
+    return is_done;
+}
+
+/*  Applied once the subtree is written: the final mode of a created directory may forbid
+ *  writing into it, and every child written changes its timestamps. A single open() resolves
+ *  the path for all of the fd-based calls.
+ */
+static int finish_directory(const char *real_path, const struct stat *attribute, bool is_created, const int option[]) {
+    int fd, retval = 0;
+
+    if (!is_created && !is_preserving(option)) {
+        return 0;
+    }
+
+    if ((fd = open(real_path, O_RDONLY | O_DIRECTORY)) == -1) {
+        return -1;
+    }
+
+    if (is_created && option['M'] == 0) {
+        retval |= fchmod(fd, attribute->st_mode);
+    }
+
+    retval |= preserve_attributes(fd, attribute, option);
+    retval |= close(fd);
+
+    return retval;
+}
+
+static int copy_empty_directory(const struct entry *source, struct entry *destination, const int option[]) {
     if (!is_directory_write_permitted(destination->previous)) {
         log_error("cp: cannot access '%s': Permission denied", destination->previous->received_path);
         return -1;
@@ -57,17 +424,172 @@ static int copy_empty_directory(const struct entry *source, struct entry *destin
     int retval = mkdir(destination->real_path, source->attribute->st_mode);
     destination->attribute = (struct stat*)malloc(sizeof (struct stat));
     stat(destination->real_path, destination->attribute);
+
+    if (retval == 0) {
+        retval = finish_directory(destination->real_path, source->attribute, false, option);
+    }
     
     return retval;
 }
 
-static int copy_directory_recursively(const struct entry *source, struct entry *destination, const int option[]) {
+/*  The destination directory must exist before its children are written. A created one stays
+ *  writable until its subtree is done, and is_created_buf tells that its mode is still to be applied.
+ */
+static int prepare_directory(const struct entry *directory, struct entry *destination, bool *is_created_buf) {
+    *is_created_buf = false;
+
+    if (!is_entry_located(destination)) {
+        if (mkdir(destination->real_path, S_IRWXU | S_IRWXG | S_IROTH | S_IXOTH) == -1) {
+            log_error("cp: cannot create directory '%s'", destination->received_path);
+            return -1;
+        }
+        destination->attribute = (struct stat*)malloc(sizeof (struct stat));
+        stat(destination->real_path, destination->attribute);
+        *is_created_buf = true;
+
+    } else if (!is_directory(destination)) {
+        log_error("cp: cannot overwrite non-directory '%s' with directory '%s'", destination->received_path, directory->received_path);
+        return -1;
+    }
+
+    return 0;
+}
+
+/* a directory whose subtree is being copied by the pool */
+static struct subtree * new_subtree(const struct entry *directory, const struct entry *destination, bool is_created, struct subtree *parent) {
+    struct subtree *subtree = (struct subtree *)malloc(sizeof (struct subtree));
+    subtree->real_path = strdup(destination->real_path);
+    subtree->attribute = *directory->attribute;
+    subtree->is_created = is_created;
+    atomic_init(&subtree->pending, 1);
+    subtree->parent = parent;
+
+    if (parent != NULL) {
+        atomic_fetch_add(&parent->pending, 1);
+    }
+
+    return subtree;
+}
+
+/* drop one reference of the subtree, and finish every directory that is done */
+static void finish_subtree(struct subtree *subtree) {
+    struct subtree *parent;
+
+    while (subtree != NULL && atomic_fetch_sub(&subtree->pending, 1) == 1) {
+        atomic_fetch_or(&pool_retval, finish_directory(subtree->real_path, &subtree->attribute, subtree->is_created, pool_option));
+        free(subtree->real_path);
+        parent = subtree->parent;
+        free(subtree);
+        subtree = parent;
+    }
+}
+
+/*  Under --io-uring, the small files that a scan finds are gathered, and copied a batch at a
+ *  time by the ring of the scanning thread. A file the batch fails on is copied the usual way.
+ */
+typedef struct uring_batch {
+    struct uring *ring;         /* NULL if io_uring is not available */
+    struct entry *sources[URING_BATCH_SIZE];
+    struct entry *destinations[URING_BATCH_SIZE];
+    struct uring_copy copies[URING_BATCH_SIZE];
+    size_t copies_nums;
+    int retval;                 /* of the batches flushed when full */
+} uring_batch;
+
+static __thread struct uring_batch *current_batch;
+
+static int flush_uring_batch(const int option[]) {
+    struct uring_batch *batch = current_batch;
+    int retval;
+
+    if (batch == NULL) {
+        return 0;
+    }
+
+    if (batch->copies_nums > 0 && copy_files_by_uring(batch->ring, batch->copies, batch->copies_nums) == -1) {
+        close_uring(batch->ring);
+        batch->ring = NULL;
+    }
+
+    for (size_t i = 0; i < batch->copies_nums; i++) {
+        if (batch->copies[i].result == 0) {
+            pthread_mutex_lock(&stats_lock);
+            record_copy(&stats, COPY_BY_URING, batch->copies[i].size);
+            pthread_mutex_unlock(&stats_lock);
+
+        } else {
+            batch->retval |= copy_file(batch->sources[i], batch->destinations[i], option);
+        }
+        count_progress(&copy_progress, 1, batch->copies[i].size);
+        free_entry(batch->sources[i]);
+        free_entry(batch->destinations[i]);
+    }
+
+    batch->copies_nums = 0;
+    retval = batch->retval;
+    batch->retval = 0;
+    return retval;
+}
+
+/*  Queue a new file that fits the batch, and take over the entries, or return false to have
+ *  it copied the usual way. Attributes and hard links need the fds or the (dev, ino) records,
+ *  so such files are left out.
+ */
+static bool try_queue_uring_copy(struct entry *source, struct entry *destination, const int option[]) {
+    struct uring_batch *batch;
+    struct uring_copy *copy;
+
+    if (option['U'] == 0 || is_preserving(option) || (option['L'] == 1 && source->attribute->st_nlink > 1) ||
+        source->attribute->st_size > URING_MAX_FILE_SIZE || is_entry_located(destination) ||
+        !is_directory_write_permitted(destination->previous)) {
+        return false;
+    }
+
+    if (current_batch == NULL) {
+        current_batch = (struct uring_batch *)calloc(1, sizeof (struct uring_batch));
+        current_batch->ring = open_uring();
+    }
+
+    if ((batch = current_batch)->ring == NULL) {
+        return false;
+    }
+
+    copy = &batch->copies[batch->copies_nums];
+    copy->source_path = source->real_path;
+    copy->destination_path = destination->real_path;
+    copy->mode = source->attribute->st_mode;
+    copy->size = source->attribute->st_size;
+    batch->sources[batch->copies_nums] = source;
+    batch->destinations[batch->copies_nums] = destination;
+
+    if (++batch->copies_nums == URING_BATCH_SIZE) {
+        batch->retval |= flush_uring_batch(option);
+    }
+
+    return true;
+}
+
+static void release_uring_batch() {
+    if (current_batch != NULL) {
+        if (current_batch->ring != NULL) {
+            close_uring(current_batch->ring);
+        }
+        free(current_batch);
+        current_batch = NULL;
+    }
+}
+
+/*  With a subtree, that is under -j, files and non-empty directories are handed to the pool,
+ *  which takes over the entries. Otherwise they are copied right away, depth first.
+ */
+static int copy_directory_recursively(const struct entry *source, struct entry *destination, const int option[], struct subtree *subtree) {
     if (!is_directory_write_permitted(destination->previous)) {
         log_error("cp: cannot access '%s': Permission denied", destination->previous->received_path);
         return -1;
     }
     
     int retval = 0;
+    bool is_created;
     DIR *stream;
     struct dirent *element;
 
@@ -83,12 +605,21 @@ static int copy_directory_recursively(const struct entry *source, struct entry *
         struct entry *entry, *terminal;
         entry = get_joint_entry(element->d_name, source);
         terminal = get_real_destination(element->d_name, destination);
+        show_progress_path(&copy_progress, entry->received_path);
 
         if (is_file(entry)) {
             if (!is_file_read_permitted(entry)) {
                 log_error("cp: cannot access '%s': Permission denied", entry->received_path);
                 retval |= -1;
 
+            } else if (try_queue_uring_copy(entry, terminal, option)) {
+                entry = terminal = NULL;
+
+            } else if (subtree != NULL) {
+                atomic_fetch_add(&subtree->pending, 1);
+                push_task(entry, terminal, subtree, false);
+                entry = terminal = NULL;
+
             } else {
                 retval |= operate_file_once(entry, terminal, option);
             }
@@ -99,16 +630,26 @@ static int copy_directory_recursively(const struct entry *source, struct entry *
 
         } else if (is_empty_directory(entry)) {
             if (!is_entry_located(terminal)) {
-                retval |= copy_empty_directory(entry, terminal);
+                retval |= copy_empty_directory(entry, terminal, option);
 
             } else if (!is_directory(terminal)) {
                 log_error("cp: cannot overwrite non-directory '%s' with directory '%s'", terminal->received_path, entry->received_path);
                 retval |= -1;
+                free_entry(entry);
+                free_entry(terminal);
                 break;
             }
-            
+
+        } else if (prepare_directory(entry, terminal, &is_created) == -1) {
+            retval |= -1;
+
+        } else if (subtree != NULL) {
+            push_task(entry, terminal, new_subtree(entry, terminal, is_created, subtree), true);
+            entry = terminal = NULL;
+
         } else {
-            retval |= copy_directory_recursively(entry, terminal, option);
+            retval |= copy_directory_recursively(entry, terminal, option, NULL);
+            retval |= finish_directory(terminal->real_path, entry->attribute, is_created, option);
         }
 
         free_entry(entry);
@@ -117,34 +658,104 @@ static int copy_directory_recursively(const struct entry *source, struct entry *
 
     closedir(stream);
 
+    /* the directory is only finished after this, so its queued files must be written by then */
+    retval |= flush_uring_batch(option);
+
     return retval;
 }
 
-static int operate_directory_once(const struct entry *directory, struct entry *destination, const int option[]) {
-    if (!is_entry_located(destination)) {
-        if (is_empty_directory(directory)) {
-            return copy_empty_directory(directory, destination);
+static void run_task(struct task *task) {
+    int retval;
 
-        } else {
-            int retval = 0;
-            retval |= mkdir(destination->real_path, S_IRWXU | S_IRWXG | S_IROTH | S_IXOTH);
-            destination->attribute = (struct stat*)malloc(sizeof (struct stat));
-            stat(destination->real_path, destination->attribute);
-            retval |= copy_directory_recursively(directory, destination, option);
-            retval |= chmod(destination->real_path, directory->attribute->st_mode);
-            return retval;
+    if (task->is_directory) {
+        retval = copy_directory_recursively(task->source, task->destination, pool_option, task->subtree);
+
+    } else {
+        retval = operate_file_once(task->source, task->destination, pool_option);
+    }
+
+    atomic_fetch_or(&pool_retval, retval);
+    finish_subtree(task->subtree);
+    free_entry(task->source);
+    free_entry(task->destination);
+    free(task);
+}
+
+static void * work(void *arg) {
+    struct worker *worker = (struct worker *)arg;
+    struct task *task;
+    current_worker = worker;
+
+    while (true) {
+        if ((task = pop_task(worker)) == NULL && (task = steal_task(worker)) == NULL) {
+            if (wait_for_tasks()) break;
+            continue;
         }
 
-    } else if (!is_directory(destination)) {
-        log_error("cp: cannot overwrite non-directory '%s' with directory '%s'", destination->received_path, directory->received_path);
-        return -1;
+        run_task(task);
 
-    } else if (!is_empty_directory(destination)) {
-        return copy_directory_recursively(directory, destination, option);
+        if (atomic_fetch_sub(&outstanding_tasks, 1) == 1) {
+            pthread_mutex_lock(&idle_lock);
+            pthread_cond_broadcast(&idle_cond);
+            pthread_mutex_unlock(&idle_lock);
+        }
+    }
 
-    } else {
-        return 0;
+    release_uring_batch();
+    return NULL;
+}
+
+static int copy_directory_in_parallel(const struct entry *directory, struct entry *destination, const int option[], bool is_created) {
+    workers_nums = option['j'];
+    workers = (struct worker *)calloc(workers_nums, sizeof (struct worker));
+    pool_option = option;
+    atomic_store(&pool_retval, 0);
+
+    for (int i = 0; i < workers_nums; i++) {
+        pthread_mutex_init(&workers[i].lock, NULL);
+        workers[i].capacity = DEQUE_INITIAL_CAPACITY;
+        workers[i].tasks = (struct task **)malloc(DEQUE_INITIAL_CAPACITY * sizeof (struct task *));
+    }
+
+    push_task(get_entry_dup(directory), get_entry_dup(destination), new_subtree(directory, destination, is_created, NULL), true);
+
+    for (int i = 0; i < workers_nums; i++) {
+        pthread_create(&workers[i].thread, NULL, work, &workers[i]);
+    }
+
+    for (int i = 0; i < workers_nums; i++) {
+        pthread_join(workers[i].thread, NULL);
+    }
+
+    for (int i = 0; i < workers_nums; i++) {
+        pthread_mutex_destroy(&workers[i].lock);
+        free(workers[i].tasks);
+    }
+
+    free(workers);
+
+    return atomic_load(&pool_retval);
+}
+
+static int operate_directory_once(const struct entry *directory, struct entry *destination, const int option[]) {
+    int retval;
+    bool is_created;
+
+    if (!is_entry_located(destination) && is_empty_directory(directory)) {
+        return copy_empty_directory(directory, destination, option);
     }
+
+    if (prepare_directory(directory, destination, &is_created) == -1) {
+        return -1;
+    }
+
+    if (option['j'] > 1) {
+        return copy_directory_in_parallel(directory, destination, option, is_created);
+    }
+
+    retval = copy_directory_recursively(directory, destination, option, NULL);
+    retval |= finish_directory(destination->real_path, directory->attribute, is_created, option);
+    return retval;
 }
 
 static int operate_entry_once(const struct entry *source, const struct entry *target, const int option[]) {
@@ -155,6 +766,7 @@ static int operate_entry_once(const struct entry *source, const struct entry *ta
 
     int retval = -1;
     struct entry *destination;
+    show_progress_path(&copy_progress, source->received_path);
 
     if ((destination = get_real_destination(source->filename, target)) == NULL) {
         retval = -1;
@@ -207,11 +819,54 @@ static int operate_entries(char *paths[], size_t paths_nums, const int option[])
         free_entry(entry);
     }
 
+    release_uring_batch();
     free_entry(target);
 
     return retval;
 }
 
+static int parse_jobs(const char *arg) {
+    char *end;
+    long jobs = strtol(arg, &end, 10);
+
+    if (*arg == '\0' || *end != '\0' || jobs < 1 || jobs > MAX_JOBS) {
+        die("cp: invalid number of jobs '%s'", arg);
+    }
+
+    return jobs;
+}
+
+/* the attributes of --preserve=LIST, separated by commas */
+static void parse_preserve(const char *arg, int *option_buf) {
+    char buffer[MAX_LEN], *p, *token;
+
+    if (snprintf(buffer, MAX_LEN, "%s", arg) >= MAX_LEN) {
+        die("cp: invalid attributes '%s'", arg);
+    }
+
+    for (p = strtok_r(buffer, ",", &token); p != NULL; p = strtok_r(NULL, ",", &token)) {
+        if (strcmp(p, "links") == 0) {
+            option_buf['L'] = 1;
+
+        } else if (strcmp(p, "mode") == 0) {
+            option_buf['M'] = 1;
+
+        } else if (strcmp(p, "timestamps") == 0) {
+            option_buf['T'] = 1;
+
+        } else if (strcmp(p, "ownership") == 0) {
+            option_buf['O'] = 1;
+
+        } else if (strcmp(p, "all") == 0) {
+            option_buf['L'] = option_buf['M'] = option_buf['T'] = option_buf['O'] = 1;
+
+        } else {
+            die("cp: invalid attribute '%s'", p);
+        }
+    }
+}
+
+/* -j without a number takes the next argument, which is marked by option_buf['j'] == -1 */
 static bool try_match_option(const char *arg, int *option_buf) {
     const char *p;
 
@@ -224,6 +879,46 @@ static bool try_match_option(const char *arg, int *option_buf) {
             } else if (strcmp(p, "recursively") == 0) {
                 option_buf['r'] = 1;
 
+            } else if (strcmp(p, "archive") == 0) {
+                option_buf['r'] = 1;
+                parse_preserve("all", option_buf);
+
+            } else if (strncmp(p, "preserve=", 9) == 0) {
+                parse_preserve(p + 9, option_buf);
+
+            } else if (strcmp(p, "incremental") == 0) {
+                option_buf['u'] = 1;
+
+            } else if (strcmp(p, "checksum") == 0) {
+                option_buf['c'] = 1;
+
+            } else if (strcmp(p, "stats") == 0) {
+                option_buf['S'] = 1;
+
+            } else if (strcmp(p, "progress") == 0) {
+                option_buf['P'] = 1;
+
+            } else if (strcmp(p, "io-uring") == 0) {
+                option_buf['U'] = 1;
+
+            } else if (strcmp(p, "direct") == 0) {
+                option_buf['D'] = 1;
+
+            } else if (strcmp(p, "nocache") == 0) {
+                option_buf['N'] = 1;
+
+            } else if (strncmp(p, "jobs=", 5) == 0) {
+                option_buf['j'] = parse_jobs(p + 5);
+
+            } else if (strcmp(p, "sparse=auto") == 0) {
+                option_buf['s'] = SPARSE_AUTO;
+
+            } else if (strcmp(p, "sparse=always") == 0) {
+                option_buf['s'] = SPARSE_ALWAYS;
+
+            } else if (strcmp(p, "sparse=never") == 0) {
+                option_buf['s'] = SPARSE_NEVER;
+
             } else {
                 die("cp: unknown options '--%s'", p);
             }
@@ -237,6 +932,20 @@ static bool try_match_option(const char *arg, int *option_buf) {
                 } else if (*p == 'r') {
                     option_buf['r'] = 1;
 
+                } else if (*p == 'a') {
+                    option_buf['r'] = 1;
+                    parse_preserve("all", option_buf);
+
+                } else if (*p == 'p') {
+                    parse_preserve("mode,timestamps,ownership", option_buf);
+
+                } else if (*p == 'u') {
+                    option_buf['u'] = 1;
+
+                } else if (*p == 'j') {
+                    option_buf['j'] = *(p + 1) != '\0' ? parse_jobs(p + 1) : -1;
+                    break;
+
                 } else {
                     die("cp: unknown options -- '%c'", *p);
                 }
@@ -254,9 +963,21 @@ static void parse(int argc, char *argv[], int *option_buf, char *paths_buf[], si
     for (int i = 1; i < argc; i++) {
         if (!try_match_option(argv[i], option_buf)) {
             paths_buf[paths_nums++] = argv[i];
+
+        } else if (option_buf['j'] == -1) {
+            if (++i == argc) {
+                die("cp: option requires an argument -- 'j'");
+            }
+            option_buf['j'] = parse_jobs(argv[i]);
         }
     }
 
+    /* the prompts of -i would interleave between the workers, and with the progress line */
+    if (option_buf['i'] == 1) {
+        option_buf['j'] = 1;
+        option_buf['P'] = 0;
+    }
+
     if (paths_nums == 0) {
         die("cp: missing operand");
     }
@@ -269,12 +990,25 @@ static void parse(int argc, char *argv[], int *option_buf, char *paths_buf[], si
 }
 
 int main(int argc, char *argv[], char *envp[]) {
-    int option[128];
+    int option[128], retval;
     char *paths[MAX_SIZE];
     size_t paths_nums;
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
     puts_program_name(argv[0]);
     memset(option, 0, sizeof(option));
     setbuf(stdout, NULL);
     parse(argc, argv, option, paths, &paths_nums);
-    return operate_entries(paths, paths_nums, option);
+    copy_stream_options.sparse = option['s'];
+    copy_stream_options.is_direct = option['D'];
+    copy_stream_options.is_nocache = option['N'];
+    start_progress(&copy_progress, "cp", option['P']);
+    scan_progress_totals(&copy_progress, paths, paths_nums - 1);
+    retval = operate_entries(paths, paths_nums, option);
+    stop_progress(&copy_progress);
+    if (option['S'] == 1) {
+        clock_gettime(CLOCK_MONOTONIC, &end);
+        print_copy_stats(&stats, "cp", (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9);
+    }
+    return retval;
 }
\ No newline at end of file
@@ -1,14 +1,17 @@
 #include <stdio.h>
+#include <stdlib.h>
+
+#include "../api/echo.h"
 
 int main(int argc, char *argv[]) {
-    if (argc == 1) {
-        fputc('\n', stdout);
-        return 0;
-    }
+    size_t length;
+    char *line = format_echo(argc, argv, &length);
 
-    for (size_t i = 1; i < argc - 1; i++) {
-        fprintf(stdout, "%s ", argv[i]);
+    if (line == NULL) {
+        return 1;
     }
 
-    fprintf(stdout, "%s\n", argv[argc - 1]);
+    fwrite(line, 1, length, stdout);
+    free(line);
+    return 0;
 }
\ No newline at end of file
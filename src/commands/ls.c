@@ -1,32 +1,395 @@
 #include <unistd.h>
 #include <dirent.h>
-#include <pwd.h>
-#include <grp.h>
 #include <time.h>
 #include <libgen.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sys/syscall.h>
 #include <sys/stat.h>
 #include <sys/types.h>
+#include <limits.h>
 
 #include "../api/entry.h"
 
-static int entry_priority_compare(const struct dirent **a, const struct dirent **b) {
-    const char *p = (*a)->d_name;
-    const char *q = (*b)->d_name;
+/* the output is written out once this much of it is gathered */
+#define OUTPUT_BUFFER_SIZE (64 << 10)
 
-    while ((*p == *q) && *p && *q) {
-        p++;
-        q++;
+/* how many chains the caches of user and group names have */
+#define NAME_BUCKETS 256
+
+/* how many minutes the cache of formatted timestamps holds */
+#define DATE_SLOTS 256
+
+/* the length of a date as "%d-%m-20%y %H:%M" formats it */
+#define DATE_LEN 16
+
+/* bytes of records asked from getdents64() at a time under -U */
+#define DIRENT_BUFFER_SIZE (64 << 10)
+
+/* the most threads that scan directories under -R */
+#define MAX_WORKERS 16
+
+/* the most bytes of -R the workers render ahead of what is written out before they wait */
+#define MAX_AHEAD_SIZE (16 << 20)
+
+/*  All of the listing is rendered into one buffer, which is written to fd once it is full,
+ *  rather than through an fprintf() per field to the unbuffered stdout. A buffer with fd -1
+ *  grows instead, and keeps a block of -R until its turn to be written comes.
+ */
+typedef struct output {
+    char *data;
+    size_t length, capacity;
+    int fd;
+} output;
+
+typedef struct name_record {
+    unsigned id;
+    char *name;
+    struct name_record *next;
+} name_record;
+
+/* uid and gid to name, each looked up once per process */
+static struct name_record *user_names[NAME_BUCKETS], *group_names[NAME_BUCKETS];
+
+static pthread_mutex_t names_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* the formatted local time of a minute, as every second in a minute formats alike */
+typedef struct date_record {
+    long long minute;
+    bool is_valid;
+    char text[DATE_LEN + 1];
+} date_record;
+
+/* each thread keeps its own, which needs no lock */
+static __thread struct date_record dates[DATE_SLOTS];
+
+/*  An entry of the directory being listed. The attributes are only read, by one fstatat()
+ *  against the directory fd, when -l needs them or d_type cannot tell a directory for -p,
+ *  and the total and the rows then share them.
+ */
+typedef struct row {
+    const char *name;
+    unsigned char type;         /* d_type */
+    bool is_directory;
+    struct stat attribute;
+    off_t sort_size;            /* of a symbolic link itself, unlike attribute, for -S and -t */
+    struct timespec sort_time;
+} row;
+
+/*  What the rows are sorted by, taken out of them once, so that the sort moves only this
+ *  small array. value is the radix key of the current pass: the first 8 bytes of the name
+ *  read big endian, which order most names without a strcmp(), or the size, the time or
+ *  the extension.
+ */
+typedef struct sort_key {
+    unsigned long long value;
+    const char *name;
+    size_t index;               /* of the row */
+} sort_key;
+
+/* a record as getdents64() fills them in */
+typedef struct dirent_record {
+    unsigned long long d_ino;
+    long long d_off;
+    unsigned short d_reclen;
+    unsigned char d_type;
+    char d_name[];
+} dirent_record;
+
+/*  A directory of -R. The workers render it into output, with its errors kept apart, and
+ *  find its subdirectories, while the main thread writes the blocks out in the order a
+ *  sequential walk would, as soon as each one is done.
+ */
+typedef struct block {
+    char *real_path;
+    char *shown_path;
+    struct output output;
+    struct output errors;
+    struct block **children;
+    size_t children_nums, children_capacity;
+    int retval;
+    bool is_started, is_done;
+    struct block *next;         /* in the stack of blocks to scan */
+} block;
+
+/* the blocks to scan, the last found first, so the workers keep close to the writer */
+static struct block *pending_blocks;
+
+static bool is_tree_listed;
+
+/* the bytes of the blocks done but not written out yet */
+static size_t ahead_bytes;
+
+/* the block the main thread waits for, which is scanned even when the others are too far ahead */
+static struct block *awaited_block;
+
+static pthread_mutex_t tree_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static pthread_cond_t pending_cond = PTHREAD_COND_INITIALIZER;
+
+static pthread_cond_t done_cond = PTHREAD_COND_INITIALIZER;
+
+/* write all of the bytes through short writes, waiting on a stdout left non-blocking */
+static void write_all(int fd, const char *bytes, size_t length) {
+    struct pollfd writable = {fd, POLLOUT, 0};
+    size_t offset = 0;
+    ssize_t written;
+
+    while (offset < length) {
+        if ((written = write(fd, bytes + offset, length - offset)) == -1) {
+            if (errno == EINTR) continue;
+            if (errno == EAGAIN && poll(&writable, 1, -1) >= 0) continue;
+            break;
+        }
+        offset += written;
     }
+}
 
-    if (*p == '\0' && *q == '\0') {
-        return 0;
+static void flush_output(struct output *output) {
+    write_all(output->fd, output->data, output->length);
+    output->length = 0;
+}
 
-    } else if (*p < *q) {
-        return -1;
+static void put_bytes(struct output *output, const char *bytes, size_t length) {
+    if (output->length + length > output->capacity && output->fd >= 0) {
+        flush_output(output);
 
-    } else {
-        return 1;
+        if (length > output->capacity) {
+            write_all(output->fd, bytes, length);
+            return;
+        }
+
+    } else if (output->length + length > output->capacity) {
+        while (output->length + length > output->capacity) {
+            output->capacity = output->capacity > 0 ? output->capacity * 2 : 4096;
+        }
+        output->data = (char *)realloc(output->data, output->capacity);
+    }
+
+    memcpy(output->data + output->length, bytes, length);
+    output->length += length;
+}
+
+static void put_string(struct output *output, const char *string) {
+    put_bytes(output, string, strlen(string));
+}
+
+static void put_char(struct output *output, char c) {
+    if (output->length == output->capacity) {
+        put_bytes(output, &c, 1);
+        return;
+    }
+    output->data[output->length++] = c;
+}
+
+/* the decimal value, right aligned to width with spaces */
+static void put_number(struct output *output, unsigned long long value, int width) {
+    char digits[24], *p = digits + sizeof (digits);
+    int length;
+
+    do {
+        *--p = '0' + value % 10;
+        value /= 10;
+    } while (value > 0);
+
+    for (length = digits + sizeof (digits) - p; length < width; length++) {
+        put_char(output, ' ');
+    }
+    put_bytes(output, p, digits + sizeof (digits) - p);
+}
+
+static char * look_up_name(struct name_record *buckets[], unsigned id, bool is_user) {
+    struct name_record *record, **bucket = &buckets[id % NAME_BUCKETS];
+
+    pthread_mutex_lock(&names_lock);
+    for (record = *bucket; record != NULL; record = record->next) {
+        if (record->id == id) break;
+    }
+    pthread_mutex_unlock(&names_lock);
+
+    if (record != NULL) {
+        return record->name;
+    }
+
+    record = (struct name_record *)malloc(sizeof (struct name_record));
+    record->id = id;
+    record->name = is_user ? get_user_name(id) : get_group_name(id);
+
+    /* another thread may have added the same id meanwhile, which only wastes a record */
+    pthread_mutex_lock(&names_lock);
+    record->next = *bucket;
+    *bucket = record;
+    pthread_mutex_unlock(&names_lock);
+
+    return record->name;
+}
+
+/*  Time zones are offset by whole minutes, so a local minute starts with a UTC one, and a
+ *  timestamp is converted only if its minute is not formatted yet.
+ */
+static const char * format_date(time_t time) {
+    long long minute = time >= 0 ? time / 60 : (time - 59) / 60;
+    struct date_record *record = &dates[(unsigned long long)minute % DATE_SLOTS];
+    struct tm local;
+
+    if (!record->is_valid || record->minute != minute) {
+        localtime_r(&time, &local);
+        strftime(record->text, sizeof (record->text), "%d-%m-20%y %H:%M", &local);
+        record->minute = minute;
+        record->is_valid = true;
     }
+
+    return record->text;
+}
+
+/* the first 8 bytes of string, big endian and padded with zeros, which order as the string does */
+static unsigned long long get_prefix(const char *string) {
+    unsigned long long prefix = 0;
+    int i;
+
+    for (i = 0; i < 8 && string[i] != '\0'; i++) {
+        prefix = prefix << 8 | (unsigned char)string[i];
+    }
+
+    return i > 0 ? prefix << (8 * (8 - i)) : 0;
+}
+
+static const char * get_extension(const char *name) {
+    const char *dot = strrchr(name, '.');
+    return dot != NULL ? dot : "";
+}
+
+/* byte by byte, as in the C locale */
+static int compare_by_name(const void *a, const void *b) {
+    return strcmp(((const struct sort_key *)a)->name, ((const struct sort_key *)b)->name);
+}
+
+static int compare_by_extension(const void *a, const void *b) {
+    const struct sort_key *p = (const struct sort_key *)a, *q = (const struct sort_key *)b;
+    int retval = strcmp(get_extension(p->name), get_extension(q->name));
+
+    return retval != 0 ? retval : strcmp(p->name, q->name);
+}
+
+/*  A stable LSD radix sort by value, a byte at a time. The counts of all 8 bytes are taken in
+ *  one read of the keys, and the bytes that all of the keys share, such as the high bytes of
+ *  small sizes, are skipped.
+ */
+static void radix_sort(struct sort_key *keys, struct sort_key *buffer, size_t key_nums) {
+    struct sort_key *source = keys, *target = buffer, *swap;
+    size_t counts[8][256], offset, count;
+    unsigned long long value;
+
+    if (key_nums < 2) {
+        return;
+    }
+
+    memset(counts, 0, sizeof (counts));
+    for (size_t i = 0; i < key_nums; i++) {
+        value = keys[i].value;
+        for (int byte = 0; byte < 8; byte++) {
+            counts[byte][(value >> (8 * byte)) & 0xff]++;
+        }
+    }
+
+    for (int byte = 0; byte < 8; byte++) {
+        if (counts[byte][(keys[0].value >> (8 * byte)) & 0xff] == key_nums) {
+            continue;
+        }
+
+        offset = 0;
+        for (int digit = 0; digit < 256; digit++) {
+            count = counts[byte][digit];
+            counts[byte][digit] = offset;
+            offset += count;
+        }
+
+        for (size_t i = 0; i < key_nums; i++) {
+            target[counts[byte][(source[i].value >> (8 * byte)) & 0xff]++] = source[i];
+        }
+
+        swap = source;
+        source = target;
+        target = swap;
+    }
+
+    if (source != keys) {
+        memcpy(keys, source, key_nums * sizeof (struct sort_key));
+    }
+}
+
+/*  Radix sort by the prefixes, then sort each run of keys that share a prefix of 8 bytes
+ *  with compare, which looks at the whole strings.
+ */
+static void sort_by_prefix(struct sort_key *keys, struct sort_key *buffer, size_t key_nums, int (*compare)(const void *, const void *)) {
+    size_t start = 0;
+
+    radix_sort(keys, buffer, key_nums);
+
+    for (size_t i = 1; i <= key_nums; i++) {
+        if (i < key_nums && keys[i].value == keys[start].value) {
+            continue;
+        }
+
+        if (i - start > 1 && (keys[start].value & 0xff) != 0) {
+            qsort(keys + start, i - start, sizeof (struct sort_key), compare);
+        }
+        start = i;
+    }
+}
+
+/*  Sort the rows through an array of their keys: by name, then, for the last of -t, -S and
+ *  -X given, stably by that, so that ties stay by name as in GNU ls. The names are all
+ *  different, so -r just reverses the result.
+ */
+static struct sort_key * sort_rows(const struct row rows[], size_t row_nums, const int option[]) {
+    struct sort_key *keys = (struct sort_key *)malloc((row_nums + 1) * sizeof (struct sort_key)), swap;
+    struct sort_key *buffer = (struct sort_key *)malloc((row_nums + 1) * sizeof (struct sort_key));
+
+    for (size_t i = 0; i < row_nums; i++) {
+        keys[i].value = get_prefix(rows[i].name);
+        keys[i].name = rows[i].name;
+        keys[i].index = i;
+    }
+    sort_by_prefix(keys, buffer, row_nums, compare_by_name);
+
+    if (option['s'] == 'S') {
+        for (size_t i = 0; i < row_nums; i++) {
+            keys[i].value = ~(unsigned long long)rows[keys[i].index].sort_size;
+        }
+        radix_sort(keys, buffer, row_nums);
+
+    } else if (option['s'] == 't') {
+        for (size_t i = 0; i < row_nums; i++) {
+            keys[i].value = ~(unsigned long long)rows[keys[i].index].sort_time.tv_nsec;
+        }
+        radix_sort(keys, buffer, row_nums);
+
+        /* the seconds may be negative, which flipping the sign bit orders as unsigned */
+        for (size_t i = 0; i < row_nums; i++) {
+            keys[i].value = ~((unsigned long long)rows[keys[i].index].sort_time.tv_sec ^ (1ULL << 63));
+        }
+        radix_sort(keys, buffer, row_nums);
+
+    } else if (option['s'] == 'X') {
+        for (size_t i = 0; i < row_nums; i++) {
+            keys[i].value = get_prefix(get_extension(keys[i].name));
+        }
+        sort_by_prefix(keys, buffer, row_nums, compare_by_extension);
+    }
+
+    if (option['r'] == 1) {
+        for (size_t i = 0, j = row_nums; i + 1 < j; i++, j--) {
+            swap = keys[i];
+            keys[i] = keys[j - 1];
+            keys[j - 1] = swap;
+        }
+    }
+
+    free(buffer);
+    return keys;
 }
 
 static void load_entry_type(char *char_buffer, mode_t mode_bits) {
@@ -34,6 +397,9 @@ static void load_entry_type(char *char_buffer, mode_t mode_bits) {
     if (S_ISREG(mode_bits)) *char_buffer = '-';
     if (S_ISCHR(mode_bits)) *char_buffer = 'c';
     if (S_ISBLK(mode_bits)) *char_buffer = 'b';
+    if (S_ISLNK(mode_bits)) *char_buffer = 'l';
+    if (S_ISFIFO(mode_bits)) *char_buffer = 'p';
+    if (S_ISSOCK(mode_bits)) *char_buffer = 's';
 }
 
 static void load_permission_info(char *string_buffer, mode_t mode_bits) {
@@ -53,150 +419,726 @@ static void load_permission_info(char *string_buffer, mode_t mode_bits) {
     if (mode_bits & S_IXOTH) string_buffer[8] = 'x';
 }
 
-static void print_blocks_numbers(struct dirent **entries, struct entry *directory, size_t entry_nums, const int option[]) {
-    struct entry *entry;
+/* -0 ends every line with a NUL instead, for names that may hold newlines */
+static void put_line_end(struct output *output, const int option[]) {
+    put_char(output, option['0'] == 1 ? '\0' : '\n');
+}
+
+static void put_total(struct output *output, off_t total_block_nums, const int option[]) {
+    put_string(output, "total ");
+    put_number(output, 4 * total_block_nums, 0);
+    put_line_end(output, option);
+}
+
+static void print_blocks_numbers(struct output *output, const struct row rows[], size_t row_nums, const int option[]) {
     off_t block_size = sysconf(_SC_PAGE_SIZE), total_block_nums = 0;
 
-    for (size_t i = 0; i < entry_nums; i++) {
-        if (*(entries[i]->d_name) == '.' && option['a'] == 0) {
-            continue;
+    for (size_t i = 0; i < row_nums; i++) {
+        off_t size = rows[i].attribute.st_size;
+        total_block_nums += (size / block_size) + ((size % block_size) ? 1 : 0);
+    }
+
+    put_total(output, total_block_nums, option);
+}
+
+/* the length of the UTF-8 sequence at p, or 0 if it is not a valid one, overlong or a surrogate */
+static size_t get_utf8_length(const unsigned char *p) {
+    size_t length;
+    unsigned code_point;
+
+    if (*p < 0x80) {
+        return 1;
+
+    } else if ((*p & 0xe0) == 0xc0) {
+        length = 2;
+        code_point = *p & 0x1f;
+
+    } else if ((*p & 0xf0) == 0xe0) {
+        length = 3;
+        code_point = *p & 0x0f;
+
+    } else if ((*p & 0xf8) == 0xf0) {
+        length = 4;
+        code_point = *p & 0x07;
+
+    } else {
+        return 0;
+    }
+
+    for (size_t i = 1; i < length; i++) {
+        if ((p[i] & 0xc0) != 0x80) {
+            return 0;
         }
+        code_point = (code_point << 6) | (p[i] & 0x3f);
+    }
 
-        entry = get_joint_entry(entries[i]->d_name, directory);
+    if ((length == 2 && code_point < 0x80) || (length == 3 && code_point < 0x800) ||
+        (length == 4 && code_point < 0x10000) || code_point > 0x10ffff ||
+        (code_point >= 0xd800 && code_point <= 0xdfff)) {
+        return 0;
+    }
 
-        off_t block_nums = (entry->attribute->st_size / block_size) + ((entry->attribute->st_size % block_size) ? 1 : 0);
-        
-        total_block_nums += block_nums;
+    return length;
+}
 
-        free_entry(entry);
+static bool is_utf8(const char *string) {
+    size_t length;
+
+    for (const unsigned char *p = (const unsigned char *)string; *p; p += length) {
+        if ((length = get_utf8_length(p)) == 0) {
+            return false;
+        }
     }
 
-    fprintf(stdout, "total %ld\n", 4 * total_block_nums);
+    return true;
 }
 
-static int list_entry_attribute(struct entry *entry) {
-    char entry_type, permission_info[10], date[32];
-    char *username, *groupname;
-    off_t size;
-    mode_t mode_bits;
-    nlink_t nlink;
+/*  A byte that is not part of valid UTF-8 is written as \u00XX, which decodes to the Latin-1
+ *  character of the same value, so the entry carries the raw bytes in base64 as well.
+ */
+static void put_json_chars(struct output *output, const char *string) {
+    const char *hex = "0123456789abcdef";
+    size_t length;
 
-    mode_bits = entry->attribute->st_mode;
+    for (const unsigned char *p = (const unsigned char *)string; *p; p += length) {
+        length = get_utf8_length(p);
 
-    load_entry_type(&entry_type, mode_bits);
-    load_permission_info(permission_info, mode_bits);
+        if (*p == '"' || *p == '\\') {
+            put_char(output, '\\');
+            put_char(output, *p);
 
-    nlink = entry->attribute->st_nlink;
+        } else if (*p < 0x20 || length == 0) {
+            put_string(output, "\\u00");
+            put_char(output, hex[*p >> 4]);
+            put_char(output, hex[*p & 0xf]);
+            length = 1;
 
-    username = strdup(getpwuid(entry->attribute->st_uid)->pw_name);
-    groupname = strdup(getgrgid(entry->attribute->st_gid)->gr_name);
+        } else {
+            put_bytes(output, (const char *)p, length);
+        }
+    }
+}
 
-    size = entry->attribute->st_size;
+static void put_json_base64(struct output *output, const char *key, const char *string) {
+    const char *digits = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+    const unsigned char *p = (const unsigned char *)string;
+    size_t length = strlen(string);
+    unsigned long group;
 
-    strftime(date, 32, "%d-%m-20%y %H:%M", localtime(&entry->attribute->st_ctime));
+    put_string(output, ",\"");
+    put_string(output, key);
+    put_string(output, "\":\"");
 
-    fprintf(stdout, "%c%s %lu %s %s %5ld %s ", entry_type, permission_info, nlink, username, groupname, size, date);
-    
-    free(username);
-    free(groupname);
+    for (size_t i = 0; i < length; i += 3) {
+        group = (unsigned long)p[i] << 16;
+        if (i + 1 < length) group |= (unsigned long)p[i + 1] << 8;
+        if (i + 2 < length) group |= p[i + 2];
+
+        put_char(output, digits[group >> 18]);
+        put_char(output, digits[(group >> 12) & 0x3f]);
+        put_char(output, i + 1 < length ? digits[(group >> 6) & 0x3f] : '=');
+        put_char(output, i + 2 < length ? digits[group & 0x3f] : '=');
+    }
+
+    put_char(output, '"');
+}
+
+static void put_json_number(struct output *output, const char *key, long long value) {
+    put_string(output, ",\"");
+    put_string(output, key);
+    put_string(output, "\":");
+    if (value < 0) {
+        put_char(output, '-');
+        put_number(output, -(unsigned long long)value, 0);
+
+    } else {
+        put_number(output, value, 0);
+    }
+}
+
+static const char * get_type_name(mode_t mode_bits) {
+    if (S_ISREG(mode_bits)) return "file";
+    if (S_ISDIR(mode_bits)) return "directory";
+    if (S_ISLNK(mode_bits)) return "symlink";
+    if (S_ISCHR(mode_bits)) return "character";
+    if (S_ISBLK(mode_bits)) return "block";
+    if (S_ISFIFO(mode_bits)) return "fifo";
+    if (S_ISSOCK(mode_bits)) return "socket";
+    return "unknown";
+}
+
+/*  --json writes a line of one object per entry, holding the raw fields of stat, so that
+ *  nothing is formatted for a reader that would only parse it back. path is directory/name,
+ *  or the path given when directory is NULL.
+ */
+static void list_entry_json(struct output *output, const char *directory, const char *name, const char *path,
+                            const struct stat *attribute) {
+    char *joint_path;
+    size_t length;
+
+    put_string(output, "{\"name\":\"");
+    put_json_chars(output, name);
+    put_string(output, "\",\"path\":\"");
+    if (directory != NULL) {
+        put_json_chars(output, directory);
+        if ((length = strlen(directory)) > 0 && directory[length - 1] != '/') {
+            put_char(output, '/');
+        }
+        put_json_chars(output, name);
+
+    } else {
+        put_json_chars(output, path);
+    }
+    put_char(output, '"');
+
+    if (!is_utf8(name)) {
+        put_json_base64(output, "name_bytes", name);
+    }
+
+    if (directory != NULL && (!is_utf8(directory) || !is_utf8(name))) {
+        length = strlen(directory);
+        joint_path = (char *)malloc(length + strlen(name) + 2);
+        sprintf(joint_path, (length > 0 && directory[length - 1] != '/') ? "%s/%s" : "%s%s", directory, name);
+        put_json_base64(output, "path_bytes", joint_path);
+        free(joint_path);
+
+    } else if (directory == NULL && !is_utf8(path)) {
+        put_json_base64(output, "path_bytes", path);
+    }
+
+    put_string(output, ",\"type\":\"");
+    put_string(output, get_type_name(attribute->st_mode));
+    put_char(output, '"');
+    put_json_number(output, "mode", attribute->st_mode);
+    put_json_number(output, "nlink", attribute->st_nlink);
+    put_json_number(output, "uid", attribute->st_uid);
+    put_json_number(output, "gid", attribute->st_gid);
+    put_json_number(output, "size", attribute->st_size);
+    put_json_number(output, "blocks", attribute->st_blocks);
+    put_json_number(output, "ino", attribute->st_ino);
+    put_json_number(output, "dev", attribute->st_dev);
+    put_json_number(output, "atime", attribute->st_atim.tv_sec);
+    put_json_number(output, "atime_nsec", attribute->st_atim.tv_nsec);
+    put_json_number(output, "mtime", attribute->st_mtim.tv_sec);
+    put_json_number(output, "mtime_nsec", attribute->st_mtim.tv_nsec);
+    put_json_number(output, "ctime", attribute->st_ctim.tv_sec);
+    put_json_number(output, "ctime_nsec", attribute->st_ctim.tv_nsec);
+    put_string(output, "}\n");
+}
+
+static int list_entry_attribute(struct output *output, const struct stat *attribute) {
+    char entry_type, permission_info[10];
+
+    load_entry_type(&entry_type, attribute->st_mode);
+    load_permission_info(permission_info, attribute->st_mode);
+
+    put_char(output, entry_type);
+    put_string(output, permission_info);
+    put_char(output, ' ');
+    put_number(output, attribute->st_nlink, 0);
+    put_char(output, ' ');
+    put_string(output, look_up_name(user_names, attribute->st_uid, true));
+    put_char(output, ' ');
+    put_string(output, look_up_name(group_names, attribute->st_gid, false));
+    put_char(output, ' ');
+    put_number(output, attribute->st_size, 5);
+    put_char(output, ' ');
+    put_string(output, format_date(attribute->st_ctime));
+    put_char(output, ' ');
 
     return 0;
 }
 
-static int list_directory_once(struct entry *directory, const int option[]) {
-    int retval = 0, entry_nums;
-    struct dirent **entries;
-    struct entry *entry;
+/* like stat(), but a dangling symbolic link is listed as itself */
+static int load_attribute(int directory_fd, const char *name, struct stat *attribute_buf) {
+    if (fstatat(directory_fd, name, attribute_buf, 0) == 0) {
+        return 0;
+    }
+    return fstatat(directory_fd, name, attribute_buf, AT_SYMLINK_NOFOLLOW);
+}
+
+/* an error goes to stderr at once, after what is listed so far, or is kept with its block */
+static void report_error(struct output *output, struct output *errors, const char *message) {
+    if (errors->fd >= 0) {
+        flush_output(output);
+    }
+
+    put_string(errors, message);
+    put_char(errors, '\n');
+
+    if (errors->fd >= 0) {
+        flush_output(errors);
+    }
+}
+
+/* directory/name, without doubling a trailing '/' of directory */
+static char * join_path(const char *directory, const char *name) {
+    size_t length = strlen(directory);
+    char *path = (char *)malloc(length + strlen(name) + 2);
+
+    if (length > 0 && directory[length - 1] == '/') {
+        sprintf(path, "%s%s", directory, name);
+
+    } else {
+        sprintf(path, "%s/%s", directory, name);
+    }
+
+    return path;
+}
+
+static struct block * new_block(char *real_path, char *shown_path) {
+    struct block *block = (struct block *)calloc(1, sizeof (struct block));
+    block->real_path = real_path;
+    block->shown_path = shown_path;
+    block->output.fd = -1;
+    block->errors.fd = -1;
+    return block;
+}
+
+static void add_child_block(struct block *block, const char *name, int directory_fd, unsigned char type) {
+    struct stat attribute;
+
+    /* "." and ".." are directories too, whatever the file system tells of their type */
+    if (strcmp(name, ".") == 0 || strcmp(name, "..") == 0) {
+        return;
+    }
 
-    if ((entry_nums = scandir(directory->real_path, &entries, NULL, entry_priority_compare)) < 0) {
+    /* like GNU ls, -R does not follow symbolic links to directories */
+    if (type == DT_UNKNOWN) {
+        if (fstatat(directory_fd, name, &attribute, AT_SYMLINK_NOFOLLOW) == -1 || !S_ISDIR(attribute.st_mode)) {
+            return;
+        }
+
+    } else if (type != DT_DIR) {
+        return;
+    }
+
+    if (block->children_nums == block->children_capacity) {
+        block->children_capacity = block->children_capacity > 0 ? block->children_capacity * 2 : 16;
+        block->children = (struct block **)realloc(block->children, block->children_capacity * sizeof (struct block *));
+    }
+
+    block->children[block->children_nums++] = new_block(join_path(block->real_path, name), join_path(block->shown_path, name));
+}
+
+/* fill in the row of name, and read its attributes if they are needed; -1 if they cannot be */
+static int load_row(struct output *output, struct output *errors, int directory_fd, const char *shown_path,
+                    const char *name, unsigned char type, const int option[], struct row *row_buf) {
+    char message[MAX_LEN + PATH_MAX];
+    struct stat attribute;
+
+    row_buf->name = name;
+    row_buf->type = type;
+    row_buf->is_directory = type == DT_DIR;
+
+    /* a symbolic link to a directory also gets its '/' under -p, as stat() follows it */
+    if (option['l'] == 0 && option['J'] == 0 && option['s'] != 't' && option['s'] != 'S' &&
+        (option['p'] == 0 || (type != DT_UNKNOWN && type != DT_LNK))) {
+        return 0;
+    }
+
+    if (load_attribute(directory_fd, name, &row_buf->attribute) == -1) {
+        snprintf(message, sizeof (message), "ls: cannot access '%s/%s': %s", shown_path, name, strerror(errno));
+        report_error(output, errors, message);
         return -1;
     }
 
+    row_buf->is_directory = S_ISDIR(row_buf->attribute.st_mode);
+    row_buf->sort_size = row_buf->attribute.st_size;
+    row_buf->sort_time = row_buf->attribute.st_mtim;
+
+    /* like GNU ls, -S and -t go by a symbolic link itself, not by what it points to */
+    if ((option['s'] == 't' || option['s'] == 'S') && (type == DT_LNK || type == DT_UNKNOWN) &&
+        fstatat(directory_fd, name, &attribute, AT_SYMLINK_NOFOLLOW) == 0) {
+        row_buf->sort_size = attribute.st_size;
+        row_buf->sort_time = attribute.st_mtim;
+    }
+    return 0;
+}
+
+static int list_row(struct output *output, const char *shown_path, const struct row *row, const int option[]) {
+    int retval = 0;
+
+    if (option['J'] == 1) {
+        list_entry_json(output, shown_path, row->name, NULL, &row->attribute);
+        return 0;
+    }
+
     if (option['l'] == 1) {
-        print_blocks_numbers(entries, directory, entry_nums, option);
+        retval = list_entry_attribute(output, &row->attribute);
+    }
+
+    put_string(output, row->name);
+    if (option['p'] == 1 && row->is_directory) {
+        put_char(output, '/');
+    }
+    put_line_end(output, option);
+
+    return retval;
+}
+
+static int open_directory(struct output *output, struct output *errors, const char *real_path, const char *shown_path) {
+    char message[MAX_LEN + PATH_MAX];
+    int directory_fd;
+
+    if ((directory_fd = open(real_path, O_RDONLY | O_DIRECTORY)) == -1) {
+        snprintf(message, sizeof (message), "ls: cannot open directory '%s': %s", shown_path, strerror(errno));
+        report_error(output, errors, message);
+    }
+
+    return directory_fd;
+}
+
+/*  -U lists the entries in the order getdents64() returns them, a buffer of records at a
+ *  time straight to the output, so memory stays the same however large the directory is.
+ *  -l stats each entry once, and so puts the total after the entries, when it is known.
+ */
+static int list_directory_unsorted(struct output *output, struct output *errors, const char *real_path, const char *shown_path,
+                                   const int option[], struct block *block) {
+    int retval = 0, directory_fd;
+    bool is_total_needed = option['l'] == 1 && option['J'] == 0;
+    off_t block_size = sysconf(_SC_PAGE_SIZE), total_block_nums = 0;
+    long bytes;
+    char *buffer;
+    struct dirent_record *record;
+    struct row row;
+    char message[MAX_LEN + PATH_MAX];
+
+    if ((directory_fd = open_directory(output, errors, real_path, shown_path)) == -1) {
+        return -1;
+    }
+
+    buffer = (char *)malloc(DIRENT_BUFFER_SIZE);
+
+    while ((bytes = syscall(SYS_getdents64, directory_fd, buffer, DIRENT_BUFFER_SIZE)) > 0) {
+        for (long offset = 0; offset < bytes; offset += record->d_reclen) {
+            record = (struct dirent_record *)(buffer + offset);
+
+            if (*(record->d_name) == '.' && option['a'] == 0) {
+                continue;
+            }
+
+            if (load_row(output, errors, directory_fd, shown_path, record->d_name, record->d_type, option, &row) == -1) {
+                retval = -1;
+                continue;
+            }
+
+            if (block != NULL) {
+                add_child_block(block, row.name, directory_fd, record->d_type);
+            }
+
+            if (is_total_needed) {
+                total_block_nums += (row.attribute.st_size / block_size) + ((row.attribute.st_size % block_size) ? 1 : 0);
+            }
+
+            retval |= list_row(output, shown_path, &row, option);
+        }
+    }
+
+    if (bytes == -1) {
+        snprintf(message, sizeof (message), "ls: reading directory '%s': %s", shown_path, strerror(errno));
+        report_error(output, errors, message);
+        retval = -1;
+
+    } else if (is_total_needed) {
+        put_total(output, total_block_nums, option);
+    }
+
+    free(buffer);
+    close(directory_fd);
+
+    return retval;
+}
+
+/* with a block, that is under -R, its subdirectories are also gathered, in the listed order */
+static int list_directory_once(struct output *output, struct output *errors, const char *real_path, const char *shown_path,
+                               const int option[], struct block *block) {
+    int retval = 0, entry_nums, directory_fd;
+    size_t row_nums = 0;
+    struct dirent **entries;
+    struct row *rows, *row;
+    struct sort_key *keys;
+    char message[MAX_LEN + PATH_MAX];
+
+    if (option['U'] == 1) {
+        return list_directory_unsorted(output, errors, real_path, shown_path, option, block);
+    }
+
+    /* the rows are sorted afterwards, by their keys */
+    if ((entry_nums = scandir(real_path, &entries, NULL, NULL)) < 0) {
+        snprintf(message, sizeof (message), "ls: cannot open directory '%s': %s", shown_path, strerror(errno));
+        report_error(output, errors, message);
+        return -1;
+    }
+
+    if ((directory_fd = open_directory(output, errors, real_path, shown_path)) == -1) {
+        for (int i = 0; i < entry_nums; i++) free(entries[i]);
+        free(entries);
+        return -1;
     }
 
+    rows = (struct row *)malloc((entry_nums + 1) * sizeof (struct row));
+
     for (int i = 0; i < entry_nums; i++) {
         if (*(entries[i]->d_name) == '.' && option['a'] == 0) {
-            free(entries[i]);
             continue;
         }
 
-        entry = get_joint_entry(entries[i]->d_name, directory);
-
-        if (option['l'] == 1) {
-            retval |= list_entry_attribute(entry);
+        if (load_row(output, errors, directory_fd, shown_path, entries[i]->d_name, entries[i]->d_type, option, &rows[row_nums]) == -1) {
+            retval = -1;
+            continue;
         }
 
-        if (option['p'] == 1) {
-            if (is_directory(entry)) {
-                fprintf(stdout, "%s/\n", entries[i]->d_name);
-                free_entry(entry);
-                continue;
-            }
+        row_nums++;
+    }
+
+    keys = sort_rows(rows, row_nums, option);
+
+    if (block != NULL) {
+        for (size_t i = 0; i < row_nums; i++) {
+            row = &rows[keys[i].index];
+            add_child_block(block, row->name, directory_fd, row->type);
         }
+    }
 
-        fprintf(stdout, "%s\n", entry->filename);
+    close(directory_fd);
 
-        free_entry(entry);
+    if (option['l'] == 1 && option['J'] == 0) {
+        print_blocks_numbers(output, rows, row_nums, option);
+    }
 
+    for (size_t i = 0; i < row_nums; i++) {
+        retval |= list_row(output, shown_path, &rows[keys[i].index], option);
+    }
+
+    for (int i = 0; i < entry_nums; i++) {
         free(entries[i]);
     }
 
     free(entries);
+    free(rows);
+    free(keys);
 
     return retval;
 }
 
-static int list_file_once(struct entry *file, const int option[]) {
+/*  The next block to scan: the last one found, or, once the blocks done are MAX_AHEAD_SIZE
+ *  ahead of the writer, only the one the writer waits for; NULL if there is none to take.
+ */
+static struct block * take_pending_block() {
+    struct block *block, **p;
+
+    if (ahead_bytes < MAX_AHEAD_SIZE) {
+        if ((block = pending_blocks) != NULL) {
+            pending_blocks = block->next;
+        }
+        return block;
+    }
+
+    if (awaited_block == NULL || awaited_block->is_started) {
+        return NULL;
+    }
+    for (p = &pending_blocks; *p != NULL && *p != awaited_block; p = &(*p)->next);
+    if (*p == NULL) {
+        return NULL;
+    }
+    *p = awaited_block->next;
+    return awaited_block;
+}
+
+static void * scan_blocks(void *arg) {
+    const int *option = (const int *)arg;
+    struct block *block;
+
+    pthread_mutex_lock(&tree_lock);
+
+    while (true) {
+        while ((block = take_pending_block()) == NULL && !is_tree_listed) {
+            pthread_cond_wait(ahead_bytes < MAX_AHEAD_SIZE ? &pending_cond : &done_cond, &tree_lock);
+        }
+
+        if (block == NULL) {
+            break;
+        }
+        block->is_started = true;
+        pthread_mutex_unlock(&tree_lock);
+
+        /* JSON Lines carry the paths instead of headers */
+        if (option['J'] == 0) {
+            put_string(&block->output, block->shown_path);
+            put_char(&block->output, ':');
+            put_line_end(&block->output, option);
+        }
+        block->retval = list_directory_once(&block->output, &block->errors, block->real_path, block->shown_path, option, block);
+
+        pthread_mutex_lock(&tree_lock);
+        for (size_t i = block->children_nums; i > 0; i--) {
+            block->children[i - 1]->next = pending_blocks;
+            pending_blocks = block->children[i - 1];
+        }
+        block->is_done = true;
+        ahead_bytes += block->output.length + block->errors.length;
+        pthread_cond_broadcast(&done_cond);
+        if (block->children_nums > 0) {
+            pthread_cond_broadcast(&pending_cond);
+        }
+    }
+
+    pthread_mutex_unlock(&tree_lock);
+    return NULL;
+}
+
+/*  Write the block and then its subtree, each after a blank line, and free them. The workers
+ *  held back by MAX_AHEAD_SIZE are woken both to scan the block waited for and as the bytes
+ *  ahead drop below it.
+ */
+static int emit_block(struct output *output, struct output *errors, struct block *block, const int option[]) {
     int retval;
+
+    pthread_mutex_lock(&tree_lock);
+    if (!block->is_done) {
+        awaited_block = block;
+        pthread_cond_broadcast(&done_cond);
+        while (!block->is_done) {
+            pthread_cond_wait(&done_cond, &tree_lock);
+        }
+        awaited_block = NULL;
+    }
+    pthread_mutex_unlock(&tree_lock);
+
+    put_bytes(output, block->output.data, block->output.length);
+    if (block->errors.length > 0) {
+        flush_output(output);
+        put_bytes(errors, block->errors.data, block->errors.length);
+        flush_output(errors);
+    }
+    retval = block->retval;
+
+    pthread_mutex_lock(&tree_lock);
+    if (ahead_bytes >= MAX_AHEAD_SIZE && ahead_bytes - block->output.length - block->errors.length < MAX_AHEAD_SIZE) {
+        pthread_cond_broadcast(&done_cond);
+    }
+    ahead_bytes -= block->output.length + block->errors.length;
+    pthread_mutex_unlock(&tree_lock);
+
+    for (size_t i = 0; i < block->children_nums; i++) {
+        if (option['J'] == 0) {
+            put_line_end(output, option);
+        }
+        retval |= emit_block(output, errors, block->children[i], option);
+    }
+
+    free(block->real_path);
+    free(block->shown_path);
+    free(block->output.data);
+    free(block->errors.data);
+    free(block->children);
+    free(block);
+
+    return retval;
+}
+
+/*  -R scans the subdirectories on a pool of threads, twice as many as the processors, since
+ *  a large tree spends its time waiting for the disk rather than computing.
+ */
+static int list_tree(struct output *output, struct output *errors, struct entry *directory, const int option[]) {
+    pthread_t workers[MAX_WORKERS];
+    long workers_nums = sysconf(_SC_NPROCESSORS_ONLN) * 2;
+    struct block *root;
+    int retval;
+
+    if (workers_nums < 2) workers_nums = 2;
+    if (workers_nums > MAX_WORKERS) workers_nums = MAX_WORKERS;
+
+    is_tree_listed = false;
+    ahead_bytes = 0;
+    pending_blocks = root = new_block(strdup(directory->real_path), strdup(directory->received_path));
+
+    for (long i = 0; i < workers_nums; i++) {
+        pthread_create(&workers[i], NULL, scan_blocks, (void *)option);
+    }
+
+    retval = emit_block(output, errors, root, option);
+
+    pthread_mutex_lock(&tree_lock);
+    is_tree_listed = true;
+    pthread_cond_broadcast(&pending_cond);
+    pthread_mutex_unlock(&tree_lock);
+
+    for (long i = 0; i < workers_nums; i++) {
+        pthread_join(workers[i], NULL);
+    }
+
+    return retval;
+}
+
+static int list_file_once(struct output *output, struct entry *file, const int option[]) {
+    int retval = 0;
+    if (option['J'] == 1) {
+        list_entry_json(output, NULL, file->filename, file->received_path, file->attribute);
+        return 0;
+    }
     if (option['l'] == 1) {
-        retval = list_entry_attribute(file);
+        retval = list_entry_attribute(output, file->attribute);
     }
-    fprintf(stdout, "%s\n", file->filename);
+    put_string(output, file->filename);
+    put_line_end(output, option);
     return retval;
 }
 
-static int list_entry(struct entry *entry, const int option[]) {
+/* what is listed so far is written out before an error, so that the two stay in order */
+static int list_entry(struct output *output, struct output *errors, struct entry *entry, const int option[]) {
     if (!is_entry_located(entry)) {
+        flush_output(output);
         log_error("ls: cannot access '%s': No such file or directory", entry->received_path);
         return -1;
 
     } else if (is_file(entry)) {
         if (!is_file_read_permitted(entry)) {
+            flush_output(output);
             log_error("ls: cannot access '%s': Permission denied", entry->received_path);
             return -1;
         }
-        return list_file_once(entry, option);
+        return list_file_once(output, entry, option);
 
     } else if (is_directory(entry)) {
         if (!is_directory_read_permitted(entry)) {
+            flush_output(output);
             log_error("ls: cannot access '%s': Permission denied", entry->received_path);
             return -1;
         }
-        return list_directory_once(entry, option);
+
+        if (option['R'] == 1) {
+            return list_tree(output, errors, entry, option);
+        }
+        return list_directory_once(output, errors, entry->real_path, entry->received_path, option, NULL);
     }
     return -1;
 }
 
-static int list_entries(char *paths[], size_t path_nums, const int option[]) {
+static int list_entries(struct output *output, struct output *errors, char *paths[], size_t path_nums, const int option[]) {
     int retval = 0;
 
     for (size_t i = 0; i < path_nums; i++) {
         struct entry *entry = get_entries_chain(paths[i]);
 
-        if (is_directory(entry) && path_nums > 1) {
-            fprintf(stdout, "%s:\n", paths[i]);
+        /* the blocks of -R have their own headers, and JSON Lines carry the paths instead */
+        if (is_directory(entry) && path_nums > 1 && option['R'] == 0 && option['J'] == 0) {
+            put_string(output, paths[i]);
+            put_char(output, ':');
+            put_line_end(output, option);
         }
 
-        retval |= list_entry(entry, option);
+        retval |= list_entry(output, errors, entry, option);
 
-        if (is_directory(entry) && path_nums > 1 && i < path_nums) {
-            fputc('\n', stdout);
+        if (is_directory(entry) && path_nums > 1 && i + 1 < path_nums && option['J'] == 0) {
+            put_line_end(output, option);
         }
 
         free_entry(entry);
     }
+
+    flush_output(output);
    
     return retval;
 }
@@ -210,6 +1152,18 @@ static bool try_match_option(const char *arg, int *option_buffer) {
             if (strcmp(p, "all") == 0) {
                 option_buffer['a'] = 1;
 
+            } else if (strcmp(p, "recursive") == 0) {
+                option_buffer['R'] = 1;
+
+            } else if (strcmp(p, "reverse") == 0) {
+                option_buffer['r'] = 1;
+
+            } else if (strcmp(p, "json") == 0) {
+                option_buffer['J'] = 1;
+
+            } else if (strcmp(p, "zero") == 0) {
+                option_buffer['0'] = 1;
+
             } else {
                 die("ls: unknown options '--%s'", p);
             }
@@ -226,6 +1180,24 @@ static bool try_match_option(const char *arg, int *option_buffer) {
                 } else if (*p == 'p') {
                     option_buffer['p'] = 1;
 
+                } else if (*p == 'R') {
+                    option_buffer['R'] = 1;
+
+                } else if (*p == 'U') {
+                    option_buffer['U'] = 1;
+
+                } else if (*p == 't' || *p == 'S' || *p == 'X') {
+                    option_buffer['s'] = *p;
+
+                } else if (*p == 'r') {
+                    option_buffer['r'] = 1;
+
+                } else if (*p == '0') {
+                    option_buffer['0'] = 1;
+
+                } else if (*p == 'f') {
+                    option_buffer['f'] = 1;
+
                 } else {
                     die("ls: unknown options -- '%c'", *p);
     
@@ -247,6 +1219,12 @@ static void parse(int argc, char *argv[], int *option_buf, char *paths_buf[], si
         }
     }
 
+    /* like GNU ls, -f lists all in directory order, and without details */
+    if (option_buf['f'] == 1) {
+        option_buf['a'] = option_buf['U'] = 1;
+        option_buf['l'] = 0;
+    }
+
     if (path_nums == 0) {
         paths_buf[0] = ".";
         path_nums = 1;
@@ -259,9 +1237,18 @@ int main(int argc, char *argv[]) {
     int option[128];
     char *paths[MAX_SIZE];
     size_t path_nums;
+    struct output output, errors;
     puts_program_name(argv[0]);
     memset(option, 0, sizeof(option));
     setbuf(stdout, NULL);
     parse(argc, argv, option, paths, &path_nums);
-    return list_entries(paths, path_nums, option);
+    output.data = (char *)malloc(OUTPUT_BUFFER_SIZE);
+    output.length = 0;
+    output.capacity = OUTPUT_BUFFER_SIZE;
+    output.fd = STDOUT_FILENO;
+    errors.data = (char *)malloc(MAX_LEN + PATH_MAX);
+    errors.length = 0;
+    errors.capacity = MAX_LEN + PATH_MAX;
+    errors.fd = STDERR_FILENO;
+    return list_entries(&output, &errors, paths, path_nums, option);
 }
\ No newline at end of file
@@ -1,9 +1,19 @@
 #include <unistd.h>
+#include <sys/stat.h>
 
 #include "../api/entry.h"
+#include "../api/progress.h"
 
+/* the entries moved, for --progress and --stats */
+static struct progress move_progress;
+
+/* every move ends in this rename(), so the entries are counted here, once they are moved */
 static int move_entry(const struct entry *source, const struct entry *destination) {
-	return rename(source->real_path, destination->real_path);
+    if (rename(source->real_path, destination->real_path) == -1) {
+        return -1;
+    }
+    count_progress(&move_progress, 1, is_file(source) ? source->attribute->st_size : 0);
+    return 0;
 }
 
 static int overwrite_entry(const struct entry *source, const struct entry *destination, const int option[]) {
@@ -85,7 +95,7 @@ static int operate_entry_once(const struct entry *source, const struct entry *ta
         }
 
     } else if (is_directory(source)) {
-        struct entry *entry_cwd = get_entries_chain(getcwd(NULL, 0));
+        struct entry *entry_cwd = get_entries_chain(get_working_directory());
 
         if (!is_directory_write_permitted(source)) {
             log_error("mv: cannot access '%s': Permission denied", source->received_path);
@@ -120,6 +130,7 @@ static int operate_entries(char *paths[], const int option[], size_t paths_nums)
     for (size_t i = 0; i < paths_nums - 1; i++) {
         struct entry *entry;
         entry = get_entries_chain(paths[i]);
+        show_progress_path(&move_progress, entry->received_path);
         retval |= operate_entry_once(entry, target, option);
         free_entry(entry);
     }
@@ -143,6 +154,12 @@ static bool try_match_option(const char *arg, int *option_buf) {
                 option_buf['f'] = 1;
                 option_buf['i'] = 0;
 
+            } else if (strcmp(p, "progress") == 0) {
+                option_buf['P'] = 1;
+
+            } else if (strcmp(p, "stats") == 0) {
+                option_buf['S'] = 1;
+
             } else {
                 die("mv: unknown options '--%s'", p);
             }
@@ -182,16 +199,29 @@ static void parse(int argc, char *argv[], int *option_buf, char *paths_buf[], si
         die("mv: missing operand");
     }
 
+    /* the prompts of -i would interleave with the progress line */
+    if (option_buf['i'] == 1) {
+        option_buf['P'] = 0;
+    }
+
     *paths_nums_buf = paths_nums;
 }
 
 int main(int argc, char *argv[]) {
-    int option[128];
+    int option[128], retval;
     char *paths[MAX_SIZE];
     size_t paths_nums;
     puts_program_name(argv[0]);
     memset(option, 0, sizeof(option));
     setbuf(stdout, NULL);
     parse(argc, argv, option, paths, &paths_nums);
-    return operate_entries(paths, option, paths_nums);
+    /* each entry is a single rename(), so the totals are just the operands */
+    start_progress(&move_progress, "mv", option['P']);
+    set_progress_totals(&move_progress, paths_nums - 1, 0);
+    retval = operate_entries(paths, option, paths_nums);
+    stop_progress(&move_progress);
+    if (option['S'] == 1) {
+        print_progress_stats(&move_progress);
+    }
+    return retval;
 }
\ No newline at end of file
@@ -2,13 +2,14 @@
 #include <stdlib.h>
 #include <unistd.h>
 
-#include "../api/error.h"
+#include "../api/entry.h"
 
 static void print_working_directory() {
-    fprintf(stdout, "%s\n", getcwd(NULL, 0));
+    fprintf(stdout, "%s\n", get_working_directory());
 }
 
-int main() {
+int main(int argc, char *argv[]) {
+    puts_program_name(argv[0]);
     setbuf(stdout, NULL);
     print_working_directory();
     return 0;
@@ -1,7 +1,12 @@
 #include <unistd.h>
 #include <dirent.h>
+#include <sys/stat.h>
 
 #include "../api/entry.h"
+#include "../api/progress.h"
+
+/* the files and bytes removed, for --progress and --stats */
+static struct progress remove_progress;
 
 static int remove_file(const struct entry *file, const int option[]) {
     if (option['i'] == 1) {
@@ -10,7 +15,11 @@ static int remove_file(const struct entry *file, const int option[]) {
         fgetc(stdin);
         if (c != 'y') return 0;
     }
-    return unlink(file->real_path);
+    if (unlink(file->real_path) == -1) {
+        return -1;
+    }
+    count_progress(&remove_progress, 1, file->attribute->st_size);
+    return 0;
 }
 
 static int remove_empty_directory(const struct entry *directory, const int option[]) {
@@ -45,6 +54,7 @@ static int remove_directory_recursively(const struct entry *directory, const int
         }
 
         entry = get_joint_entry(element->d_name, directory);
+        show_progress_path(&remove_progress, entry->received_path);
 
         if (is_file(entry)) {
             retval |= remove_file(entry, option);
@@ -77,7 +87,7 @@ static int remove_directory_recursively(const struct entry *directory, const int
 
 static int remove_directory(const struct entry *entry, const int option[]) {
     int retval;
-    struct entry *entry_cwd = get_entries_chain(getcwd(NULL, 0));
+    struct entry *entry_cwd = get_entries_chain(get_working_directory());
 
     if (option['d'] == 0 && option['r'] == 0) {
         log_error("rm: cannot remove '%s': Is a directory", entry->received_path);
@@ -154,7 +164,7 @@ static bool try_match_option(const char *arg, int *option_buf) {
             if (strcmp(p, "recursive") == 0) {
                 option_buf['r'] = 1;
 
-            } else if (strcmp(p, "dir")) {
+            } else if (strcmp(p, "dir") == 0) {
                 option_buf['d'] = 1;
 
             } else if (strcmp(p, "interactive") == 0) {
@@ -165,6 +175,12 @@ static bool try_match_option(const char *arg, int *option_buf) {
                 option_buf['f'] = 1;
                 option_buf['i'] = 0;
 
+            } else if (strcmp(p, "progress") == 0) {
+                option_buf['P'] = 1;
+
+            } else if (strcmp(p, "stats") == 0) {
+                option_buf['S'] = 1;
+
             } else {
                 die("rm: unknown options '--%s'", p);
             }
@@ -211,16 +227,28 @@ static void parse(int argc, char *argv[], int *option_buf, char *paths_buf[], si
         die("rm: missing operand");
     }
 
+    /* the prompts of -i would interleave with the progress line */
+    if (option_buf['i'] == 1) {
+        option_buf['P'] = 0;
+    }
+
     *paths_nums_buf = paths_nums;
 }
 
 int main(int argc, char *argv[]) {
-    int option[128];
+    int option[128], retval;
     char *paths[MAX_SIZE];
     size_t paths_nums;
     puts_program_name(argv[0]);
     memset(option, 0, sizeof(option));
     setbuf(stdout, NULL);
     parse(argc, argv, option, paths, &paths_nums);
-    return remove_entries(paths, paths_nums, option);
+    /* no totals: a scan beside the removal would find the trees already thinned, and undercount */
+    start_progress(&remove_progress, "rm", option['P']);
+    retval = remove_entries(paths, paths_nums, option);
+    stop_progress(&remove_progress);
+    if (option['S'] == 1) {
+        print_progress_stats(&remove_progress);
+    }
+    return retval;
 }
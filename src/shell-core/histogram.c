@@ -0,0 +1,105 @@
+#include "histogram.h"
+
+#define SUB_BUCKET_COUNT (1 << SUB_BUCKET_BITS)
+
+#define SUB_BUCKET_HALF_COUNT (1 << (SUB_BUCKET_BITS - 1))
+
+static int get_bucket_index(long long value) {
+    int exponent;
+
+    if (value < SUB_BUCKET_COUNT) {
+        return value;
+    }
+
+    exponent = 63 - __builtin_clzll(value) - (SUB_BUCKET_BITS - 1);
+    return exponent * SUB_BUCKET_HALF_COUNT + (value >> exponent);
+}
+
+/* the highest value that would be counted in the same bucket */
+static long long get_bucket_value(int index) {
+    int exponent;
+
+    if (index < SUB_BUCKET_COUNT) {
+        return index;
+    }
+
+    exponent = index / SUB_BUCKET_HALF_COUNT - 1;
+    return (((long long)(index % SUB_BUCKET_HALF_COUNT + SUB_BUCKET_HALF_COUNT + 1)) << exponent) - 1;
+}
+
+extern void record_value(struct histogram *histogram, long long value) {
+    int index;
+
+    if (value < 0) {
+        value = 0;
+    }
+
+    if ((index = get_bucket_index(value)) >= HISTOGRAM_BUCKETS) {
+        index = HISTOGRAM_BUCKETS - 1;
+    }
+
+    histogram->counts[index] += 1;
+    histogram->total_count += 1;
+    histogram->sum += value;
+    if (value > histogram->max) {
+        histogram->max = value;
+    }
+}
+
+/* percentile ranges from 0 to 100, and the result never exceeds the max recorded value */
+extern long long get_percentile(const struct histogram *histogram, double percentile) {
+    unsigned long long count = 0, target;
+
+    if (histogram->total_count == 0) {
+        return 0;
+    }
+
+    target = (unsigned long long)(percentile / 100 * histogram->total_count + 0.5);
+    if (target == 0) {
+        target = 1;
+    }
+
+    for (int i = 0; i < HISTOGRAM_BUCKETS; i++) {
+        if ((count += histogram->counts[i]) >= target) {
+            long long value = get_bucket_value(i);
+            return value < histogram->max ? value : histogram->max;
+        }
+    }
+
+    return histogram->max;
+}
+
+/* in the percentile distribution format printed by HdrHistogram, so that its plotting tools can read it */
+extern void dump_histogram(const struct histogram *histogram, const char *name, FILE *stream) {
+    unsigned long long count = 0;
+
+    fprintf(stream, "# %s (us)\n", name);
+    fprintf(stream, "%12s %14s %10s %14s\n\n", "Value", "Percentile", "TotalCount", "1/(1-Percentile)");
+
+    for (int i = 0; i < HISTOGRAM_BUCKETS; i++) {
+        if (histogram->counts[i] == 0) {
+            continue;
+        }
+
+        double percentile;
+        long long value = get_bucket_value(i);
+
+        count += histogram->counts[i];
+        percentile = (double)count / histogram->total_count;
+
+        if (value > histogram->max) {
+            value = histogram->max;
+        }
+
+        if (count < histogram->total_count) {
+            fprintf(stream, "%12lld %14.12f %10llu %14.2f\n", value, percentile, count, 1 / (1 - percentile));
+
+        } else {
+            fprintf(stream, "%12lld %14.12f %10llu %14s\n", value, percentile, count, "inf");
+        }
+    }
+
+    fprintf(stream, "#[Mean    = %12.3f, Max         = %12lld]\n",
+            histogram->total_count ? (double)histogram->sum / histogram->total_count : 0.0, histogram->max);
+    fprintf(stream, "#[Total count = %10llu, SubBuckets = %d]\n\n", histogram->total_count, SUB_BUCKET_COUNT);
+}
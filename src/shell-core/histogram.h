@@ -0,0 +1,26 @@
+#include <stdio.h>
+
+/*  A log-linear histogram in the style of HdrHistogram: values below 2^SUB_BUCKET_BITS are
+ *  counted exactly, and every power of two above that is split into 2^(SUB_BUCKET_BITS-1)
+ *  linear sub-buckets, which keeps the relative error of any reported value under 2^-(SUB_BUCKET_BITS-1).
+ *
+ *  Values are expected in microseconds, up to 2^HISTOGRAM_MAX_BITS (about 12 days).
+ */
+#define SUB_BUCKET_BITS 6
+
+#define HISTOGRAM_MAX_BITS 40
+
+#define HISTOGRAM_BUCKETS ((HISTOGRAM_MAX_BITS - SUB_BUCKET_BITS + 2) << (SUB_BUCKET_BITS - 1))
+
+typedef struct histogram {
+    unsigned long long counts[HISTOGRAM_BUCKETS];
+    unsigned long long total_count;
+    long long max;
+    long long sum;
+} histogram;
+
+extern void record_value(struct histogram *histogram, long long value);
+
+extern long long get_percentile(const struct histogram *histogram, double percentile);
+
+extern void dump_histogram(const struct histogram *histogram, const char *name, FILE *stream);
@@ -0,0 +1,141 @@
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+
+#include "ring.h"
+
+static void wait_event(atomic_uint *events, unsigned observed) {
+    syscall(SYS_futex, events, FUTEX_WAIT_PRIVATE, observed, NULL, NULL, 0);
+}
+
+static void wake_event(atomic_uint *events) {
+    atomic_fetch_add(events, 1);
+    syscall(SYS_futex, events, FUTEX_WAKE_PRIVATE, 1, NULL, NULL, 0);
+}
+
+/* the last of the two sides to close the ring frees it */
+static void release_ring(struct ring *ring) {
+    if (atomic_fetch_sub(&ring->open_sides, 1) == 1) {
+        free(ring->data);
+        free(ring);
+    }
+}
+
+/* return NULL if out of memory, in which case the caller connects the stages by a pipe */
+extern struct ring * open_ring() {
+    struct ring *ring = (struct ring *)malloc(sizeof (struct ring));
+
+    if (ring == NULL || (ring->data = (char *)malloc(RING_SIZE)) == NULL) {
+        free(ring);
+        return NULL;
+    }
+
+    atomic_init(&ring->head, 0);
+    atomic_init(&ring->tail, 0);
+    atomic_init(&ring->read_events, 0);
+    atomic_init(&ring->write_events, 0);
+    atomic_init(&ring->is_reader_waiting, false);
+    atomic_init(&ring->is_writer_waiting, false);
+    atomic_init(&ring->is_read_closed, false);
+    atomic_init(&ring->is_write_closed, false);
+    atomic_init(&ring->open_sides, 2);
+
+    return ring;
+}
+
+/*  Write all of the bytes, sleeping while the ring is full. Return -1 with EPIPE if the reader
+ *  has closed its side, as a write into a pipe without readers would.
+ *
+ *  The positions and the waiting flags are all sequentially consistent, so that either the
+ *  producer sees the flag of the consumer that is about to sleep, or the consumer sees the
+ *  new tail before it does; the same holds the other way around.
+ */
+extern ssize_t write_ring(struct ring *ring, const char *p, size_t count) {
+    unsigned tail = atomic_load_explicit(&ring->tail, memory_order_relaxed), head, events;
+    size_t written = 0, chunk, offset, first;
+
+    while (written < count) {
+        if (atomic_load(&ring->is_read_closed)) {
+            errno = EPIPE;
+            return -1;
+        }
+
+        head = atomic_load(&ring->head);
+        if (tail - head == RING_SIZE) {
+            events = atomic_load(&ring->read_events);
+            atomic_store(&ring->is_writer_waiting, true);
+            if (atomic_load(&ring->head) == head && !atomic_load(&ring->is_read_closed)) {
+                wait_event(&ring->read_events, events);
+            }
+            atomic_store(&ring->is_writer_waiting, false);
+            continue;
+        }
+
+        chunk = count - written < RING_SIZE - (tail - head) ? count - written : RING_SIZE - (tail - head);
+        offset = tail & (RING_SIZE - 1);
+        first = chunk < RING_SIZE - offset ? chunk : RING_SIZE - offset;
+        memcpy(ring->data + offset, p + written, first);
+        memcpy(ring->data, p + written + first, chunk - first);
+
+        tail += chunk;
+        written += chunk;
+        atomic_store(&ring->tail, tail);
+        if (atomic_load(&ring->is_reader_waiting)) {
+            wake_event(&ring->write_events);
+        }
+    }
+
+    return written;
+}
+
+/* read what is there, up to count bytes, sleeping while the ring is empty; return 0 at the end */
+extern ssize_t read_ring(struct ring *ring, char *p, size_t count) {
+    unsigned head = atomic_load_explicit(&ring->head, memory_order_relaxed), tail, events;
+    size_t chunk, offset, first;
+
+    while ((tail = atomic_load(&ring->tail)) == head) {
+        /* the tail is looked at once more after the close, as the writer may write and then close */
+        if (atomic_load(&ring->is_write_closed)) {
+            if (atomic_load(&ring->tail) == head) {
+                return 0;
+            }
+            continue;
+        }
+
+        events = atomic_load(&ring->write_events);
+        atomic_store(&ring->is_reader_waiting, true);
+        if (atomic_load(&ring->tail) == head && !atomic_load(&ring->is_write_closed)) {
+            wait_event(&ring->write_events, events);
+        }
+        atomic_store(&ring->is_reader_waiting, false);
+    }
+
+    chunk = count < tail - head ? count : tail - head;
+    offset = head & (RING_SIZE - 1);
+    first = chunk < RING_SIZE - offset ? chunk : RING_SIZE - offset;
+    memcpy(p, ring->data + offset, first);
+    memcpy(p + first, ring->data, chunk - first);
+
+    atomic_store(&ring->head, head + chunk);
+    if (atomic_load(&ring->is_writer_waiting)) {
+        wake_event(&ring->read_events);
+    }
+
+    return chunk;
+}
+
+extern void close_ring_reader(struct ring *ring) {
+    atomic_store(&ring->is_read_closed, true);
+    wake_event(&ring->read_events);
+    release_ring(ring);
+}
+
+extern void close_ring_writer(struct ring *ring) {
+    atomic_store(&ring->is_write_closed, true);
+    wake_event(&ring->write_events);
+    release_ring(ring);
+}
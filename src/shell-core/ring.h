@@ -0,0 +1,34 @@
+#include <stddef.h>
+#include <stdatomic.h>
+#include <sys/types.h>
+
+#include "../api/bool.h"
+
+/* the capacity of a ring between two stages run as threads, a power of two */
+#define RING_SIZE (256 << 10)
+
+/*  A single-producer, single-consumer byte queue between two pipeline stages that run as threads
+ *  of the shell, in place of a kernel pipe. Each side only stores its own position and reads
+ *  the other's, so the data path takes no lock. A side that finds the ring full or empty sleeps
+ *  on a futex of the events of the other side, which only bumps and wakes it when it has said
+ *  it is waiting. The ring is freed when both sides have closed it.
+ */
+typedef struct ring {
+    char *data;
+    atomic_uint head;               /* bytes read so far, stored by the consumer alone */
+    atomic_uint tail;               /* bytes written so far, stored by the producer alone */
+    atomic_uint read_events, write_events;
+    atomic_bool is_reader_waiting, is_writer_waiting;
+    atomic_bool is_read_closed, is_write_closed;
+    atomic_int open_sides;
+} ring;
+
+extern struct ring * open_ring();
+
+extern ssize_t write_ring(struct ring *ring, const char *p, size_t count);
+
+extern ssize_t read_ring(struct ring *ring, char *p, size_t count);
+
+extern void close_ring_reader(struct ring *ring);
+
+extern void close_ring_writer(struct ring *ring);
@@ -52,13 +52,55 @@ static int read_line(char *buffer, size_t buffer_max_size) {
     return count;
 }
 
+/* in microseconds, and comparable across the shell and its children */
+static long long trace_clock() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000LL + ts.tv_nsec / 1000;
+}
+
+/*  The file is written in the Chrome trace-event format, which Perfetto and chrome://tracing load.
+ *  The closing ']' is written by trace_close(), though the viewers also accept the file without it,
+ *  e.g. if the shell is killed.
+ */
+static void trace_open(const char *path) {
+    char event[MAX_LEN];
+    int len;
+
+    if ((trace_fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_APPEND | O_CLOEXEC, 0644)) == -1) {
+        log_error("shell: cannot open trace file '%s'", path);
+        return;
+    }
+
+    len = snprintf(event, sizeof (event), "[{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":%d,\"args\":{\"name\":\"shell\"}}", getpid());
+    write(trace_fd, event, len);
+}
+
+/* Every event goes out in one write() on an O_APPEND fd, so that those of the children do not interleave */
+static void trace_span(const char *name, long long start) {
+    if (trace_fd == -1) return;
+    char event[MAX_LEN];
+    int len;
+    pid_t pid = getpid();
+
+    len = snprintf(event, sizeof (event), ",\n{\"name\":\"%s\",\"ph\":\"X\",\"ts\":%lld,\"dur\":%lld,\"pid\":%d,\"tid\":%d}",
+                   name, start, trace_clock() - start, pid, pid);
+    write(trace_fd, event, len);
+}
+
+static void trace_close() {
+    if (trace_fd == -1) return;
+    write(trace_fd, "\n]\n", 3);
+    close(trace_fd);
+}
+
 static void print_prompt() {
     const char *cwd, *username;
     char hostname[MAX_LEN], ch;
     struct passwd *passwd;
     size_t path_len;
 
-    cwd = getcwd(NULL, 0);
+    cwd = get_working_directory();
     passwd = getpwuid(getuid());
     sys_home_directory = passwd->pw_dir;
     username = passwd->pw_name;
@@ -81,72 +123,98 @@ static void print_prompt() {
     }
 }
 
-static void try_unfold_path(const char *path, char *path_buf) {
+/* Returns -1 if the unfolded path does not fit in MAX_LEN */
+static int unfold_path(const char *path, char *path_buf) {
+    int length;
+
     if (*path == '~') {
         char *sys_home = strdup(getpwuid(getuid())->pw_dir);
         if (*(path + 1) == '\0') {
-            if (snprintf(path_buf, MAX_LEN, "%s", sys_home) > MAX_LEN) {
-                die("shell: Error: buffer overflowed");
-            }
+            length = snprintf(path_buf, MAX_LEN, "%s", sys_home);
 
         } else if (*(path + 1) != '/') {
-            if (snprintf(path_buf, MAX_LEN, "/home/%s", path + 1) > MAX_LEN) {
-                die("shell: Error: buffer overflowed");
-            }
+            length = snprintf(path_buf, MAX_LEN, "/home/%s", path + 1);
 
         } else {
-            if (snprintf(path_buf, MAX_LEN, "%s%s", sys_home, path + 1) > MAX_LEN) {
-                die("shell: Error: buffer overflowed");
-            }
+            length = snprintf(path_buf, MAX_LEN, "%s%s", sys_home, path + 1);
         }
 
         free(sys_home);
 
     } else {
-        if (snprintf(path_buf, MAX_LEN, "%s", path) > MAX_LEN) {
-            die("shell: Error: buffer overflowed");
-        }
+        length = snprintf(path_buf, MAX_LEN, "%s", path);
+    }
+
+    return length >= MAX_LEN ? -1 : 0;
+}
+
+static void try_unfold_path(const char *path, char *path_buf) {
+    if (unfold_path(path, path_buf) == -1) {
+        die("shell: Error: buffer overflowed");
+    }
+}
+
+static void free_paths(char *paths[], size_t path_nums) {
+    for (size_t i = 0; i < path_nums; i++) {
+        free(paths[i]);
     }
 }
 
-/*  Try wildcard at the same time  */
-static void load_paths(const char *path, char *paths_buf[], int *path_nums_buf) {
+/*  Try wildcard at the same time. Return -1 if the paths would overflow paths_buf, which keeps
+ *  a slot for the NULL that ends argv.
+ */
+static int load_paths(const char *path, char *paths_buf[], int *path_nums_buf) {
     char unfolded_path[MAX_LEN];
     glob_t res_paths;
+    int retval = 0;
     res_paths.gl_pathc = 0;
     res_paths.gl_pathv = NULL;
     res_paths.gl_offs = 0;
 
-    try_unfold_path(path, unfolded_path);
+    if (unfold_path(path, unfolded_path) == -1) {
+        return -1;
+    }
 
     if (glob(unfolded_path, GLOB_NOCHECK, NULL, &res_paths) == 0) {
-        for (int i = 0; i < res_paths.gl_pathc; i++) {
-            paths_buf[*path_nums_buf] = strdup(res_paths.gl_pathv[i]);
-            if ((*path_nums_buf += 1) > MAX_SIZE) {
-                die("shell: Error: buffer overflowed");
+        for (size_t i = 0; i < res_paths.gl_pathc; i++) {
+            if (*path_nums_buf + 1 >= MAX_SIZE) {
+                retval = -1;
+                break;
             }
+            paths_buf[(*path_nums_buf)++] = strdup(res_paths.gl_pathv[i]);
         }
     }
 
     globfree(&res_paths);
+    return retval;
 }
 
-/* the memory is allocated by malloc, and thus needs to be freed manually */
+/*  The memory is allocated by malloc, and thus needs to be freed manually. Return -1 if there
+ *  are no words, or if they overflow argv, which is reported and leaves argv empty, so that
+ *  the shell itself can go on.
+ */
 static int load_argv(char *command, char *argv[], int *argc_buf) {
+    int retval = 0;
     *argc_buf = 0;
 
-    for (char *token, *p = strtok_r(command, " ", &token); p; p = strtok_r(NULL, " ", &token)) {
-        if (*p == '-') {
-            argv[*argc_buf] = strdup(p);
-            if ((*argc_buf += 1) > MAX_SIZE) {
-                die("shell: Error: buffer overflowed");
-            }
+    for (char *token, *p = strtok_r(command, " ", &token); p && retval == 0; p = strtok_r(NULL, " ", &token)) {
+        if (*p != '-') {
+            retval = load_paths(p, argv, argc_buf);
+
+        } else if (*argc_buf + 1 >= MAX_SIZE) {
+            retval = -1;
 
         } else {
-            load_paths(p, argv, argc_buf);
+            argv[(*argc_buf)++] = strdup(p);
         }
     }
 
+    if (retval == -1) {
+        log_error("shell: Error: buffer overflowed");
+        free_paths(argv, *argc_buf);
+        *argc_buf = 0;
+    }
+
     argv[*argc_buf] = NULL;
     if (*argc_buf == 0) {
         return -1;
@@ -155,12 +223,6 @@ static int load_argv(char *command, char *argv[], int *argc_buf) {
     return 0;
 }
 
-static void free_paths(char *paths[], size_t path_nums) {
-    for (size_t i = 0; i < path_nums; i++) {
-        free(paths[i]);
-    }
-}
-
 static bool catch_delimiter_error(const char *line, const char *delimiter, int error_type) {
     size_t offset = strlen(delimiter);
     while (isspace(*line)) line++;
@@ -271,7 +333,9 @@ static void redirect_overwrite_fstream(char *command) {
 
     char *matched_paths[MAX_LEN];
     int matched_path_nums = 0;
-    load_paths(path, matched_paths, &matched_path_nums);
+    if (load_paths(path, matched_paths, &matched_path_nums) == -1) {
+        die("shell: Error: buffer overflowed");
+    }
     if (matched_path_nums > 1) {
         die("%s: ambiguous redirect", path);
     }
@@ -312,7 +376,9 @@ static void redirect_append_fstream(char *command) {
 
     char *matched_paths[MAX_LEN];
     int matched_path_nums = 0;
-    load_paths(path, matched_paths, &matched_path_nums);
+    if (load_paths(path, matched_paths, &matched_path_nums) == -1) {
+        die("shell: Error: buffer overflowed");
+    }
     if (matched_path_nums > 1) {
         die("%s: ambiguous redirect", path);
     }
@@ -336,6 +402,16 @@ static void redirect_append_fstream(char *command) {
     free_entry(entry);
 }
 
+/* Don't call this function unless in child process */
+static void redirect_input_fstream(const char *path) {
+    int fstream_fd;
+    if ((fstream_fd = open(path, O_RDONLY)) == -1) {
+        die("shell: cannot open '%s' : No such file or directory", path);
+    }
+    dup2(fstream_fd, fileno(stdin));
+    close(fstream_fd);
+}
+
 /* This function actually serves like strtok_r(), but it regards the whole string as one delimiter,
  * rather than a set of char delimiters.
 */
@@ -369,7 +445,12 @@ static char * strtok_l(char *string, const char *delimiter, char **save_ptr) {
 }
 
 static int load_commands(char *line, char **commands_buf, size_t *command_nums_buf) {
-    if (catch_syntax_error(line)) return -1;
+    long long start = trace_clock();
+    bool syntax_error = catch_syntax_error(line);
+    trace_span("syntax", start);
+    if (syntax_error) return -1;
+
+    start = trace_clock();
     if (load_full_command(line) == -1) return -1;
     size_t command_nums = 0;
 
@@ -384,6 +465,7 @@ static int load_commands(char *line, char **commands_buf, size_t *command_nums_b
 
     commands_buf[command_nums] = NULL;
     *command_nums_buf = command_nums;
+    trace_span("split", start);
 
     return 0;
 }
@@ -455,7 +537,7 @@ static int cd(int argc, char *argv[]) {
         retval = -1;
 
     } else {
-        retval = chdir(entry->received_path);
+        retval = change_working_directory(entry->received_path);
     }
 
     free(argv[0]);
@@ -466,10 +548,11 @@ static int cd(int argc, char *argv[]) {
 
 
 /* This function does not call fork() before execution, and thus has to call it manually */
-static void exec_once(char *command, const char *lines_buf) {
+static void exec_once(char *command, const char *lines_buf, long long fork_start) {
     int pipe_fd[2];
     int argc;
     char *argv[MAX_SIZE];
+    long long exec_start = trace_clock(), start;
 
     if (*lines_buf != '\0') {
         pipe(pipe_fd);
@@ -485,94 +568,529 @@ static void exec_once(char *command, const char *lines_buf) {
         redirect_overwrite_fstream(command);
     }
     
+    start = trace_clock();
     if (load_argv(command, argv, &argc) == -1) {
         exit(1);
     }
+    trace_span("glob", start);
 
+    start = trace_clock();
     if (locate_application_path(&argv[0]) == -1) {
         free_paths(argv,argc);
         exit(1);
     }
+    trace_span("lookup", start);
 
+    trace_span("exec", exec_start);
+    long long latency = trace_clock() - fork_start;
+    write(exec_latency_pipe[1], &latency, sizeof (latency));
     execv(argv[0], argv);
 }
 
-static int exec_normal_command(char *command) {
+static void print_latency(const char *name, const struct histogram *histogram) {
+    fprintf(stdout, "%-14s%8llu", name, histogram->total_count);
+    fprintf(stdout, "%10.3f%10.3f%10.3f%10.3f\n",
+            get_percentile(histogram, 50) / 1e3, get_percentile(histogram, 90) / 1e3,
+            get_percentile(histogram, 99) / 1e3, histogram->max / 1e3);
+}
+
+static void print_stats() {
+    fprintf(stdout, "%-14s%8s%10s%10s%10s%10s\n", "latency (ms)", "count", "p50", "p90", "p99", "max");
+    print_latency("command", &command_latency);
+    print_latency("fork-to-exec", &exec_latency);
+}
+
+/* drain what the children have reported through exec_latency_pipe so far */
+static void load_exec_latency() {
+    long long latency;
+    while (read(exec_latency_pipe[0], &latency, sizeof (latency)) == sizeof (latency)) {
+        record_value(&exec_latency, latency);
+    }
+}
+
+static void dump_stats(const char *path) {
+    FILE *stream;
+    if ((stream = fopen(path, "w")) == NULL) {
+        log_error("shell: cannot open stats file '%s'", path);
+        return;
+    }
+    dump_histogram(&command_latency, "command", stream);
+    dump_histogram(&exec_latency, "fork-to-exec", stream);
+    fclose(stream);
+}
+
+/* pid is 0 for the stages run inside the shell, whose end is loaded by the caller */
+static void load_process(struct process *processes, size_t *process_nums, pid_t pid, const char *command, long long start) {
+    struct process *process = &processes[*process_nums];
+    const char *p = command, *q = command + strlen(command);
+
+    while (isspace(*p)) p++;
+    while (q > p && isspace(*(q - 1))) q--;
+
+    process->pid = pid;
+    process->is_threaded = false;
+    process->start = start;
+    process->end = 0;
+    memset(&process->usage, 0, sizeof (process->usage));
+    snprintf(process->command, MAX_LEN, "%.*s", (int)(q - p), p);
+
+    if ((*process_nums += 1) > MAX_SIZE) {
+        die("shell: Error: buffer overflowed");
+    }
+}
+
+static int exec_normal_command(char *command, struct process *processes, size_t *process_nums) {
     char lines_buf[MAX_LEN];
+    long long start;
     memset(lines_buf, 0, sizeof (lines_buf));
 
     if (strstr(command, "<<")) {
+        start = trace_clock();
         read_multiple_lines(command, lines_buf);
+        trace_span("heredoc", start);
     }
 
     if (strncmp(command, "cd", 2) == 0) {
         char *argv[MAX_SIZE];
         int argc;
-        load_argv(command, argv, &argc);
+        if (load_argv(command, argv, &argc) == -1) {
+            return -1;
+        }
         return cd(argc, argv);
 
+    } else if (strncmp(command, "stats", 5) == 0 && (command[5] == '\0' || isspace(command[5]))) {
+        print_stats();
+
     } else {
-        if (fork() == 0) {
-            exec_once(command, lines_buf);
+        pid_t pid;
+        start = trace_clock();
+        if ((pid = fork()) == 0) {
+            exec_once(command, lines_buf, start);
         }
+        trace_span("fork", start);
+        load_process(processes, process_nums, pid, command, start);
     }
 
     return 0;
 }
 
 
-/* escape the commands before the read-multiple-lines sign "<<" */
-static void exec_commands_with_pipes(char *line) {
-    char *commands[MAX_SIZE], *p;
+/* Split a pipeline stage into at most max_argc words, without touching the original command.
+ * Returns -1 if the stage carries any redirection, or has more words than max_argc.
+ */
+static int split_stage(const char *command, char *buffer, char *argv[], int max_argc) {
+    int argc = 0;
+
+    if (strchr(command, '<') || strchr(command, '>')) {
+        return -1;
+    }
+
+    if (snprintf(buffer, MAX_LEN, "%s", command) >= MAX_LEN) {
+        return -1;
+    }
+
+    for (char *token, *p = strtok_r(buffer, " ", &token); p; p = strtok_r(NULL, " ", &token)) {
+        if (argc == max_argc) {
+            return -1;
+        }
+        argv[argc++] = p;
+    }
+
+    return argc;
+}
+
+/* bare "cat" (or "cat -") copies stdin to stdout verbatim, and thus can be dropped from a pipeline */
+static bool is_passthrough_stage(const char *command) {
+    char buffer[MAX_LEN], *argv[2];
+    int argc = split_stage(command, buffer, argv, 2);
+
+    if (argc < 1 || strcmp(argv[0], "cat") != 0) {
+        return false;
+    }
+
+    return argc == 1 || strcmp(argv[1], "-") == 0;
+}
+
+/* If the stage is "cat FILE" where FILE is a readable regular file, load its path into path_buf */
+static bool is_single_file_cat_stage(const char *command, char *path_buf) {
+    char buffer[MAX_LEN], *argv[2];
+    bool retval = false;
+
+    if (split_stage(command, buffer, argv, 2) != 2 || strcmp(argv[0], "cat") != 0) {
+        return false;
+    }
+
+    if (*argv[1] == '-' || strpbrk(argv[1], "*?[")) {
+        return false;
+    }
+
+    try_unfold_path(argv[1], path_buf);
+
+    struct entry *entry = get_entries_chain(path_buf);
+    if (is_file(entry) && is_file_read_permitted(entry)) {
+        retval = true;
+    }
+    free_entry(entry);
+
+    return retval;
+}
+
+/*  Rewrite the pipeline before launching it:
+ *
+ *  1. drop passthrough stages, e.g. "ls | cat | cat -e" => "ls | cat -e"
+ *  2. turn a leading "cat FILE | cmd" into "cmd < FILE"
+ *
+ *  Both save a process, and the latter saves a full copy of the data through a pipe as well.
+ */
+static void optimize_pipeline(char *commands[], char *input_paths[], size_t *command_nums_buf) {
     size_t command_nums = 0;
-    if ((p = strstr(line, "<<")) != NULL) {  
-        while (p >= line && *p != '|') p--;
-        p += 1;
-        if (p != line) {
-            line = p;
-            exec(line);
+    char path[MAX_LEN];
+
+    for (size_t i = 0; i < *command_nums_buf; i++) {
+        if (*command_nums_buf - (i - command_nums) > 1 && is_passthrough_stage(commands[i])) {
+            continue;
+        }
+        commands[command_nums++] = commands[i];
+    }
+
+    for (size_t i = 0; i < command_nums; i++) {
+        input_paths[i] = NULL;
+    }
+
+    if (command_nums > 1 && is_single_file_cat_stage(commands[0], path)) {
+        for (size_t i = 1; i < command_nums; i++) {
+            commands[i - 1] = commands[i];
+        }
+        command_nums -= 1;
+        input_paths[0] = strdup(path);
+    }
+
+    *command_nums_buf = command_nums;
+}
+
+/* write all of the bytes into the ring or the descriptor, resuming after partial writes and signals */
+static int write_channel(struct channel *channel, const char *p, size_t count) {
+    ssize_t nbytes;
+
+    if (channel->ring != NULL) {
+        return write_ring(channel->ring, p, count) == -1 ? -1 : 0;
+    }
+
+    while (count > 0) {
+        if ((nbytes = write(channel->fd, p, count)) == -1) {
+            if (errno == EINTR) continue;
+            return -1;
+        }
+        p += nbytes;
+        count -= nbytes;
+    }
+
+    return 0;
+}
+
+static void close_channel(struct channel *channel, bool is_input) {
+    if (channel->ring != NULL) {
+        if (is_input) {
+            close_ring_reader(channel->ring);
+
+        } else {
+            close_ring_writer(channel->ring);
+        }
+
+    } else if (channel->fd != -1) {
+        close(channel->fd);
+    }
+}
+
+static int run_echo(struct stage *stage) {
+    size_t length;
+    char *line = format_echo(stage->argc, stage->argv, &length);
+    int retval;
+
+    if (line == NULL) {
+        return -1;
+    }
+
+    retval = write_channel(&stage->output, line, length);
+    free(line);
+    return retval;
+}
+
+/* the cache of the working directory was loaded on startup, and only cd changes it, which is no stage */
+static int run_pwd(struct stage *stage) {
+    const char *cwd = get_working_directory();
+
+    if (write_channel(&stage->output, cwd, strlen(cwd)) == -1) {
+        return -1;
+    }
+    return write_channel(&stage->output, "\n", 1);
+}
+
+/* the commands that a pipeline stage runs as a thread of the shell, with no fork() and execv() */
+static const struct builtin builtins[] = {
+    { "echo", run_echo },
+    { "pwd", run_pwd }
+};
+
+/* the builtin that runs the stage, or NULL if it needs fork() and execv(), e.g. for a redirection */
+static const struct builtin * get_builtin(const char *command) {
+    char buffer[MAX_LEN], *argv[MAX_SIZE];
+
+    if (split_stage(command, buffer, argv, MAX_SIZE) < 1) {
+        return NULL;
+    }
+
+    for (size_t i = 0; i < sizeof (builtins) / sizeof (builtins[0]); i++) {
+        if (strcmp(argv[0], builtins[i].name) == 0) {
+            return &builtins[i];
+        }
+    }
+
+    return NULL;
+}
+
+static void * run_stage(void *arg) {
+    struct stage *stage = (struct stage *)arg;
+    sigset_t signals;
+
+    /* a write into a pipe whose reader is gone then fails with EPIPE, rather than killing the shell */
+    sigemptyset(&signals);
+    sigaddset(&signals, SIGPIPE);
+    pthread_sigmask(SIG_BLOCK, &signals, NULL);
+
+    stage->builtin->run(stage);
+
+    close_channel(&stage->input, true);
+    close_channel(&stage->output, false);
+    free_paths(stage->argv, stage->argc);
+    stage->process->end = trace_clock();
+    getrusage(RUSAGE_THREAD, &stage->process->usage);
+    free(stage);
+
+    return NULL;
+}
+
+/*  Expand the words of the stage and run it as a thread, which owns argv and both channels from
+ *  then on. If it cannot be started, the channels are closed as if it had written nothing, and
+ *  the next stage sees the end of its input.
+ */
+static void start_stage(const struct builtin *builtin, char *command, struct channel input, struct channel output,
+                        struct process *process) {
+    struct stage *stage = (struct stage *)malloc(sizeof (struct stage));
+
+    if (stage != NULL && load_argv(command, stage->argv, &stage->argc) == 0) {
+        stage->builtin = builtin;
+        stage->input = input;
+        stage->output = output;
+        stage->process = process;
+        if (pthread_create(&process->thread, NULL, run_stage, stage) == 0) {
+            process->is_threaded = true;
             return;
         }
+        free_paths(stage->argv, stage->argc);
+    }
+
+    close_channel(&input, true);
+    close_channel(&output, false);
+    process->end = trace_clock();
+    free(stage);
+}
+
+static void print_pipeline_plan(char *commands[], char *input_paths[], size_t command_nums) {
+    fputs("plan:", stderr);
+    for (size_t i = 0; i < command_nums; i++) {
+        const char *p = commands[i], *q = p + strlen(p);
+        while (isspace(*p)) p++;
+        while (q > p && isspace(*(q - 1))) q--;
+
+        fprintf(stderr, "%s %.*s", i == 0 ? "" : " |", (int)(q - p), p);
+        if (input_paths[i] != NULL) {
+            fprintf(stderr, " < %s", input_paths[i]);
+        }
+        if (get_builtin(commands[i]) != NULL) {
+            fputs(" (in-process)", stderr);
+        }
+    }
+    fputc('\n', stderr);
+}
+
+/*  Ask for PIPE_BUFFER_SIZE, and for half of it again as long as the kernel refuses, e.g. above
+ *  /proc/sys/fs/pipe-max-size or past the pipe pages of the user; a pipe keeps its default
+ *  capacity if even the smallest size is refused.
+ */
+static void enlarge_pipe(int fd) {
+    for (int size = PIPE_BUFFER_SIZE; size > PIPE_MIN_BUFFER_SIZE; size /= 2) {
+        if (fcntl(fd, F_SETPIPE_SZ, size) != -1) {
+            return;
+        }
+    }
+}
+
+/*  Escape the commands before the read-multiple-lines sign "<<".
+ *
+ *  Stages of builtins run as threads of the shell, and two of them next to each other are
+ *  connected by a ring rather than a pipe. A forked stage always gets a real pipe on both sides,
+ *  and so does a thread next to one. The pipes are close-on-exec, so that the ends held by the
+ *  threads do not leak into the children forked meanwhile.
+ */
+static void exec_commands_with_pipes(char *line, struct process *processes, size_t *process_nums) {
+    char *commands[MAX_SIZE], *input_paths[MAX_SIZE], *p;
+    const struct builtin *stage_builtins[MAX_SIZE];
+    size_t command_nums = 0;
+    int pipe_fd[2], input_fd = -1;
+    struct ring *ring, *input_ring = NULL;
+    struct channel input, output;
+
+    if ((p = strstr(line, "<<")) != NULL) {  
+        while (p >= line && *p != '|') p--;
+        line = p + 1;
     }
 
     for (char *token, *p = strtok_r(line, "|", &token); p; p = strtok_r(NULL, "|", &token)) {
         commands[command_nums++] = p;
     }
 
-    int pipes[command_nums - 1][2];
+    optimize_pipeline(commands, input_paths, &command_nums);
+
+    if (show_pipeline_plan) {
+        print_pipeline_plan(commands, input_paths, command_nums);
+    }
+
+    for (size_t i = 0; i < command_nums; i++) {
+        stage_builtins[i] = get_builtin(commands[i]);
+    }
+
     for (size_t i = 0; i < command_nums; i++) {
         char lines_buf[MAX_LEN];
+        long long start;
         memset(lines_buf, 0, sizeof (lines_buf));
         if (strstr(commands[i], "<<")) {
+            start = trace_clock();
             read_multiple_lines(commands[i], lines_buf);
+            trace_span("heredoc", start);
         }
 
-        if (i == 0) {
-            pipe(pipes[i]);
-            if (fork() == 0) {
-                close(pipes[i][0]);
-                dup2(pipes[i][1], fileno(stdout));
-                exec_once(commands[i], lines_buf);
+        ring = NULL;
+        if (i < command_nums - 1 && (stage_builtins[i] == NULL || stage_builtins[i + 1] == NULL ||
+                                     (ring = open_ring()) == NULL)) {
+            pipe2(pipe_fd, O_CLOEXEC);
+            enlarge_pipe(pipe_fd[1]);
+        }
+
+        pid_t pid;
+        start = trace_clock();
+        if (stage_builtins[i] != NULL) {
+            input.ring = input_ring;
+            input.fd = input_fd;
+            if (input_paths[i] != NULL) {
+                close_channel(&input, true);
+                input.ring = NULL;
+                input.fd = open(input_paths[i], O_RDONLY | O_CLOEXEC);
             }
-            close(pipes[i][1]);
-
-        } else if (i < command_nums - 1) {
-            pipe(pipes[i]);
-            if (fork() == 0) {
-                dup2(pipes[i-1][0], fileno(stdin));
-                dup2(pipes[i][1], fileno(stdout));
-                exec_once(commands[i], lines_buf);
+
+            output.ring = ring;
+            output.fd = -1;
+            if (i == command_nums - 1) {
+                output.fd = fcntl(fileno(stdout), F_DUPFD_CLOEXEC, 0);
+
+            } else if (ring == NULL) {
+                output.fd = pipe_fd[1];
             }
-            close(pipes[i-1][0]);
-            close(pipes[i][1]);
+
+            load_process(processes, process_nums, 0, commands[i], start);
+            start_stage(stage_builtins[i], commands[i], input, output, &processes[*process_nums - 1]);
+            trace_span("thread", start);
 
         } else {
-            if (fork() == 0) {
-                dup2(pipes[i-1][0], fileno(stdin));
-                exec_once(commands[i], lines_buf);
+            if ((pid = fork()) == 0) {
+                if (input_fd != -1) {
+                    dup2(input_fd, fileno(stdin));
+                    close(input_fd);
+                }
+                if (i < command_nums - 1) {
+                    close(pipe_fd[0]);
+                    dup2(pipe_fd[1], fileno(stdout));
+                    close(pipe_fd[1]);
+                }
+                if (input_paths[i] != NULL) {
+                    redirect_input_fstream(input_paths[i]);
+                }
+                exec_once(commands[i], lines_buf, start);
+            }
+
+            trace_span("fork", start);
+            load_process(processes, process_nums, pid, commands[i], start);
+
+            if (input_fd != -1) {
+                close(input_fd);
+            }
+            if (i < command_nums - 1) {
+                close(pipe_fd[1]);
             }
-            close(pipes[i-1][0]);
         }
+
+        input_ring = ring;
+        input_fd = (i < command_nums - 1 && ring == NULL) ? pipe_fd[0] : -1;
+        free(input_paths[i]);
+    }
+}
+
+/* If the command begins with keyword "time", skip it and return true */
+static bool try_match_time_keyword(char **command) {
+    char *p = *command;
+    while (isspace(*p)) p++;
+
+    if (strncmp(p, "time", 4) != 0 || (*(p + 4) != '\0' && !isspace(*(p + 4)))) {
+        return false;
+    }
+
+    p += 4;
+    while (isspace(*p)) p++;
+    *command = p;
+    return true;
+}
+
+/* Reap all the children with wait4(), loading the resource usage of each stage */
+static void wait_processes(struct process *processes, size_t process_nums) {
+    struct rusage usage;
+    pid_t pid;
+
+    for (size_t i = 0; i < process_nums; i++) {
+        if (processes[i].is_threaded) {
+            pthread_join(processes[i].thread, NULL);
+        }
+    }
+
+    while ((pid = wait4(-1, NULL, 0, &usage)) != -1) {
+        for (size_t i = 0; i < process_nums; i++) {
+            if (processes[i].pid == pid) {
+                processes[i].end = trace_clock();
+                processes[i].usage = usage;
+                break;
+            }
+        }
+    }
+}
+
+static double timeval_seconds(struct timeval tv) {
+    return tv.tv_sec + tv.tv_usec / 1e6;
+}
+
+static void print_processes_usage(const struct process *processes, size_t process_nums) {
+    fprintf(stderr, "%-10s%-10s%-10s%-12s%-8s%-8s%s\n", "real", "user", "sys", "maxrss", "nvcsw", "nivcsw", "command");
+
+    for (size_t i = 0; i < process_nums; i++) {
+        const struct process *process = &processes[i];
+        char real[16], user[16], sys[16], maxrss[16];
+
+        snprintf(real, sizeof (real), "%.3fs", (process->end - process->start) / 1e6);
+        snprintf(user, sizeof (user), "%.3fs", timeval_seconds(process->usage.ru_utime));
+        snprintf(sys, sizeof (sys), "%.3fs", timeval_seconds(process->usage.ru_stime));
+        snprintf(maxrss, sizeof (maxrss), "%ldKB", process->usage.ru_maxrss);
+
+        fprintf(stderr, "%-10s%-10s%-10s%-12s%-8ld%-8ld%s%s\n", real, user, sys, maxrss,
+                process->usage.ru_nvcsw, process->usage.ru_nivcsw, process->command,
+                process->pid == 0 ? " (in-process)" : "");
     }
 }
 
@@ -584,12 +1102,30 @@ static int exec(char *line) {
     }
 
     for (size_t i = 0; i < command_nums; i++) {
+        struct process processes[MAX_SIZE + 1];
+        size_t process_nums = 0;
+        bool timed = try_match_time_keyword(&commands[i]);
+
+        if (*commands[i] == '\0') {
+            continue;
+        }
+
+        long long command_start = trace_clock();
             if (!strchr(commands[i], '|')) {
-                exec_normal_command(commands[i]);
+                exec_normal_command(commands[i], processes, &process_nums);
             } else {
-                exec_commands_with_pipes(commands[i]);
+                exec_commands_with_pipes(commands[i], processes, &process_nums);
             }
-        while (wait(NULL) != -1) ;
+        long long start = trace_clock();
+        wait_processes(processes, process_nums);
+        trace_span("wait", start);
+
+        record_value(&command_latency, trace_clock() - command_start);
+        load_exec_latency();
+
+        if (timed) {
+            print_processes_usage(processes, process_nums);
+        }
     }
 
     return 0;
@@ -599,13 +1135,30 @@ int main(){
     char line[MAX_LEN];
     int nbytes;
     setbuf(stdout, NULL);
+    puts_program_name("shell");
+    /* export the physical path as $PWD, rather than whatever the parent has passed down */
+    change_working_directory(".");
+    show_pipeline_plan = getenv("CSHELL_PLAN") != NULL;
+    pipe2(exec_latency_pipe, O_CLOEXEC | O_NONBLOCK);
+    if (getenv("CSHELL_TRACE") != NULL) {
+        trace_open(getenv("CSHELL_TRACE"));
+    }
     print_prompt();
+    long long start = trace_clock();
     while ((nbytes = read_command(line, MAX_LEN)) != EOF) {
+        trace_span("read", start);
         if ((nbytes > MAX_LEN)) {
             die("shell: Error: buffer overflowed");
         }
+        start = trace_clock();
         exec(line);
+        trace_span("line", start);
         print_prompt();
+        start = trace_clock();
+    }
+    trace_close();
+    if (getenv("CSHELL_STATS") != NULL) {
+        dump_stats(getenv("CSHELL_STATS"));
     }
     return 0;
 }
@@ -1,22 +1,83 @@
+#define _GNU_SOURCE
 #include <ctype.h>
 #include <unistd.h>
 #include <sys/types.h>
 #include <sys/wait.h>
+#include <sys/resource.h>
 #include <sys/stat.h>
 #include <pwd.h>
 #include <fcntl.h>
 #include <glob.h>
+#include <time.h>
+#include <errno.h>
+#include <signal.h>
+#include <pthread.h>
 
 #include "../api/entry.h"
 
+#include "../api/echo.h"
+
+#include "histogram.h"
+
+#include "ring.h"
+
 #define BEGIN_WITH_DELIMITER 0100
 
 #define DELIMITER_CONCAT 0200
 
 #define EMPTY_BETWEEN_DEMILITER 0400
 
+/* capacity requested for the pipes between stages, so that cat can splice 1 MiB at a time */
+#define PIPE_BUFFER_SIZE (1 << 20)
+
+/* the default capacity of a pipe, below which asking for less is of no use */
+#define PIPE_MIN_BUFFER_SIZE (64 << 10)
+
 static const char *sys_home_directory;
 
 static const char *app_home_directory = "../commands";
 
+/* print the rewritten pipeline to stderr before launching it, enabled by env CSHELL_PLAN */
+static bool show_pipeline_plan = false;
+
+/* trace-event JSON file shared with the children, enabled by env CSHELL_TRACE=file.json */
+static int trace_fd = -1;
+
+/* end-to-end latency of every command, and latency from fork() to execv() of every stage, for builtin "stats" */
+static struct histogram command_latency, exec_latency;
+
+/* children report their fork-to-exec latency through this pipe, which is non-blocking at both ends */
+static int exec_latency_pipe[2] = { -1, -1 };
+
+/* one stage of the command being executed, for keyword "time" to report on */
+typedef struct process {
+    pid_t pid;                  /* 0 for a stage run in-process */
+    bool is_threaded;
+    pthread_t thread;
+    char command[MAX_LEN];
+    long long start;
+    long long end;
+    struct rusage usage;
+} process;
+
+/* where a stage run as a thread reads or writes: a ring shared with the stage next to it, or a descriptor */
+typedef struct channel {
+    struct ring *ring;
+    int fd;
+} channel;
+
+/* a pipeline stage run as a thread of the shell, which owns argv and the channels */
+typedef struct stage {
+    const struct builtin *builtin;
+    int argc;
+    char *argv[MAX_SIZE];
+    struct channel input, output;
+    struct process *process;
+} stage;
+
+typedef struct builtin {
+    const char *name;
+    int (*run)(struct stage *stage);
+} builtin;
+
 static int exec(char *line);